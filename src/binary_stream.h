@@ -0,0 +1,50 @@
+#ifndef __RTXBINARYSTREAM__
+#define __RTXBINARYSTREAM__
+
+#include <rtx_config.h>
+#include <cstddef>
+
+/**
+ * The binary stream format, which rtx-proc can read and write in place
+ * of the usual ^...$ text, and which rtx-stream converts to and from text
+ *
+ * The stream begins with BinaryStreamMagic and is followed by records,
+ * each of which begins with one of the BinaryRecord bytes
+ * Numbers are unsigned LEB128
+ * A plain string is a number of bytes followed by that much UTF-8
+ * A tagged string is a series of numbers ending with 0, where 2n is
+ * followed by n bytes of UTF-8 and 2k+1 stands for tag k
+ * Tags are numbered in the order they are defined, starting from 0
+ */
+enum BinaryRecord
+{
+  /**
+   * Blank text, as a plain string
+   */
+  BinaryBlank = 'b',
+  /**
+   * An LU: the wordbound blank as a plain string,
+   * then the source, target and coref as tagged strings
+   * As in the text format, an LU with one field has it in the source
+   */
+  BinaryWord = 'w',
+  /**
+   * The next tag, as a plain string including the angle brackets
+   */
+  BinaryTag = 't',
+  /**
+   * A null flush
+   */
+  BinaryNull = 'z'
+};
+
+static const char BinaryStreamMagic[] = "\x7f" "RTX1";
+static const size_t BinaryStreamMagicLength = sizeof(BinaryStreamMagic) - 1;
+
+/**
+ * Writers stop numbering tags after this many and write the rest as text,
+ * so that a stream with unbounded distinct tags uses bounded memory
+ */
+static const unsigned int BinaryStreamMaxTags = 1 << 16;
+
+#endif
@@ -0,0 +1,258 @@
+#ifndef __RTXBLOCKREADER__
+#define __RTXBLOCKREADER__
+
+#include <rtx_config.h>
+#include <lttoolbox/ustring.h>
+#include <unicode/utf8.h>
+#include <unicode/utf16.h>
+#include <unicode/ustdio.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+/**
+ * UTF-8 input stream read a block at a time
+ * get() and unget() work character by character, like InputFile,
+ * but readSpan() decodes a whole run of characters that don't need
+ * special treatment at once
+ * Files are read with read(2) so that a pipe delivering one null-flushed
+ * segment at a time doesn't block waiting for a full block, which means
+ * the FILE must not have been read from through stdio beforehand
+ * (streams without a descriptor, such as from fmemopen(), use fread())
+ */
+class BlockReader
+{
+private:
+  static const size_t BlockSize = 1 << 16;
+  FILE* in = NULL;
+  unsigned char buffer[BlockSize];
+  size_t pos = 0;
+  size_t len = 0;
+  bool hitEnd = false;
+  bool havePushback = false;
+  UChar32 pushback = 0;
+
+  /**
+   * Bytes at which readSpan() stops
+   */
+  bool delimiter[256];
+
+  /**
+   * Read more input, keeping any unread bytes
+   * @return false if nothing more could be read
+   */
+  bool fill()
+  {
+    size_t rest = len - pos;
+    memmove(buffer, buffer + pos, rest);
+    pos = 0;
+    len = rest;
+    if(in != NULL)
+    {
+      int fd = fileno(in);
+      if(fd >= 0)
+      {
+        ssize_t n;
+        do
+        {
+          n = read(fd, buffer + len, BlockSize - len);
+        } while(n < 0 && errno == EINTR);
+        if(n > 0) len += n;
+      }
+      else
+      {
+        len += fread_unlocked(buffer + len, 1, BlockSize - len, in);
+      }
+    }
+    return len > rest;
+  }
+
+  /**
+   * Decode the multibyte sequence at pos, refilling if it is incomplete
+   * @return the code point, 0xFFFD if the sequence is invalid,
+   * or -1 if it is incomplete at the end of the input
+   */
+  UChar32 decode()
+  {
+    unsigned char lead = buffer[pos];
+    size_t need = (lead >= 0xF0 ? 4 : (lead >= 0xE0 ? 3 : 2));
+    while(len - pos < need)
+    {
+      if(!fill()) return -1;
+    }
+    int32_t i = pos;
+    UChar32 c;
+    U8_NEXT(buffer, i, (int32_t)len, c);
+    pos = i;
+    return (c < 0 ? 0xFFFD : c);
+  }
+
+  static void append(UString& dest, UChar32 c)
+  {
+    if(c <= 0xFFFF)
+    {
+      dest += (UChar)c;
+    }
+    else
+    {
+      dest += (UChar)U16_LEAD(c);
+      dest += (UChar)U16_TRAIL(c);
+    }
+  }
+public:
+  /**
+   * @param delimiters - ASCII characters at which readSpan() should stop
+   * \0 is always a delimiter, since it is used for null flush
+   */
+  BlockReader(const char* delimiters)
+  {
+    memset(delimiter, 0, sizeof(delimiter));
+    delimiter[0] = true;
+    for(const char* c = delimiters; *c; c++)
+    {
+      delimiter[(unsigned char)*c] = true;
+    }
+  }
+  void wrap(FILE* f)
+  {
+    in = f;
+    pos = 0;
+    len = 0;
+    hitEnd = false;
+    havePushback = false;
+  }
+  /**
+   * Whether get() has reached the end of the input
+   */
+  bool eof()
+  {
+    return hitEnd && !havePushback;
+  }
+  UChar32 get()
+  {
+    if(havePushback)
+    {
+      havePushback = false;
+      return pushback;
+    }
+    if(pos == len && !fill())
+    {
+      hitEnd = true;
+      return U_EOF;
+    }
+    if(buffer[pos] < 0x80)
+    {
+      return buffer[pos++];
+    }
+    UChar32 c = decode();
+    if(c == -1)
+    {
+      // truncated sequence at the end of the input
+      pos = len;
+      return 0xFFFD;
+    }
+    return c;
+  }
+  void unget(UChar32 c)
+  {
+    if(hitEnd && c == U_EOF) return;
+    havePushback = true;
+    pushback = c;
+  }
+  /**
+   * Append characters to dest up to, but not including,
+   * the next delimiter or the end of the input
+   */
+  void readSpan(UString& dest)
+  {
+    if(havePushback)
+    {
+      return;
+    }
+    while(pos < len || fill())
+    {
+      size_t start = pos;
+      while(pos < len && buffer[pos] < 0x80 && !delimiter[buffer[pos]])
+      {
+        pos++;
+      }
+      dest.append(buffer + start, buffer + pos);
+      if(pos == len)
+      {
+        continue;
+      }
+      if(buffer[pos] < 0x80)
+      {
+        return;
+      }
+      UChar32 c = decode();
+      if(c == -1)
+      {
+        // leave it for get() to report
+        return;
+      }
+      append(dest, c);
+    }
+  }
+  /**
+   * Read a single byte without decoding it, for binary input
+   * @return the byte, or -1 at the end of the input
+   */
+  int getByte()
+  {
+    if(pos == len && !fill())
+    {
+      hitEnd = true;
+      return -1;
+    }
+    return buffer[pos++];
+  }
+  /**
+   * Append n bytes to dest without decoding them
+   * @return false if the input ended first
+   */
+  bool readBytes(size_t n, std::string& dest)
+  {
+    while(n > 0)
+    {
+      if(pos == len && !fill())
+      {
+        hitEnd = true;
+        return false;
+      }
+      size_t count = (len - pos < n ? len - pos : n);
+      dest.append((const char*)buffer + pos, count);
+      pos += count;
+      n -= count;
+    }
+    return true;
+  }
+  /**
+   * Read up to and including end, keeping any escapes
+   * start is assumed to have been read already and is prepended
+   */
+  UString readBlock(UChar32 start, UChar32 end)
+  {
+    UString ret;
+    append(ret, start);
+    UChar32 c = 0;
+    while(c != end)
+    {
+      c = get();
+      if(eof()) break;
+      append(ret, c);
+      if(c == '\\')
+      {
+        c = get();
+        if(eof()) break;
+        append(ret, c);
+      }
+    }
+    return ret;
+  }
+};
+
+#endif
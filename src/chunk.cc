@@ -95,44 +95,17 @@ Chunk::setChunkPart(ApertiumRE const &part, UString const &value)
 vector<UString>
 Chunk::getTags(const vector<UString>& parentTags)
 {
-  unsigned int last = 0;
   vector<UString> ret;
-  for(unsigned int i = 0, limit = target.size(); i < limit; i++)
-  {
-    if(target[i] == '<')
+  forEachTag([&](unsigned int start, unsigned int end, int ref) {
+    if(ref > 0 && ref <= (int)parentTags.size())
     {
-      last = i;
-      bool isNum = true;
-      for(unsigned int j = i+1; j < limit; j++)
-      {
-        if(target[j] == '>')
-        {
-          if(isNum)
-          {
-            unsigned int n = StringUtils::stoi(target.substr(last+1, j-last-1));
-            if(n != 0 && n <= parentTags.size())
-            {
-              ret.push_back(parentTags[n-1]);
-              last = j+1;
-              break;
-            }
-          }
-          UString tag = target.substr(last, j-last+1);
-          ret.push_back(tag);
-          last = j+1;
-          break;
-        }
-        if(!isdigit(target[j]))
-        {
-          isNum = false;
-        }
-      }
+      ret.push_back(parentTags[ref-1]);
     }
-    else if(target[i] == '\\')
+    else
     {
-      i++;
+      ret.emplace_back(target, start, end-start);
     }
-  }
+  });
   return ret;
 }
 
@@ -140,56 +113,30 @@ void
 Chunk::updateTags(const vector<UString>& parentTags)
 {
   if(isBlank) return;
-  unsigned int last = 0;
+  // most LUs only have ordinary tags, so check before building a new string
+  bool anyRefs = false;
+  forEachTag([&](unsigned int, unsigned int, int ref) {
+    if(ref != -1) anyRefs = true;
+  });
+  if(!anyRefs) return;
   UString result;
   result.reserve(target.size() + (2*parentTags.size()));
-  // a rough estimate - works if most number tags are 1 digit and most new tags are 3 chars or less
-  for(unsigned int i = 0, limit = target.size(); i < limit; i++)
-  {
-    if(target[i] == '<')
-    {
-      result += target.substr(last, i-last);
-      last = i;
-      bool isNum = true;
-      for(unsigned int j = i+1; j < limit; j++)
-      {
-        if(target[j] == '>')
-        {
-          if(isNum)
-          {
-            unsigned int n = StringUtils::stoi(target.substr(last+1, j-last-1));
-            if(n != 0 && n <= parentTags.size())
-            {
-              result += parentTags[n-1];
-            }
-          }
-          else
-          {
-            result += target.substr(last, j-last+1);
-          }
-          last = j+1;
-          break;
-        }
-        if(!isdigit(target[j]))
-        {
-          isNum = false;
-        }
-      }
-    }
-    else if(target[i] == '\\')
+  unsigned int last = 0;
+  forEachTag([&](unsigned int start, unsigned int end, int ref) {
+    if(ref == -1) return;
+    result.append(target, last, start-last);
+    if(ref > 0 && ref <= (int)parentTags.size())
     {
-      i++;
+      result += parentTags[ref-1];
     }
-  }
-  if(last != target.size()-1)
-  {
-    result += target.substr(last);
-  }
-  target = result;
+    last = end;
+  });
+  result.append(target, last, UString::npos);
+  target.swap(result);
 }
 
 void
-Chunk::output(const vector<UString>& parentTags, UFILE* out = NULL)
+Chunk::output(const vector<UString>& parentTags, OutputWriter* out = NULL)
 {
   if(contents.size() > 0)
   {
@@ -207,7 +154,7 @@ Chunk::output(const vector<UString>& parentTags, UFILE* out = NULL)
     }
     else
     {
-      write(target, out);
+      out->write(target);
     }
   }
   else
@@ -225,13 +172,13 @@ Chunk::output(const vector<UString>& parentTags, UFILE* out = NULL)
     }
     else
     {
-      u_fprintf(out, "%S^%S$", wblank.c_str(), target.c_str());
+      out->writeWord(wblank, target);
     }
   }
 }
 
 void
-Chunk::output(UFILE* out)
+Chunk::output(OutputWriter* out)
 {
   vector<UString> tags;
   output(tags, out);
@@ -274,7 +221,7 @@ Chunk::conjoin(Chunk* other)
 }
 
 void
-Chunk::writeTree(TreeMode mode, UFILE* out)
+Chunk::writeTree(TreeMode mode, OutputWriter* out)
 {
   switch(mode)
   {
@@ -377,14 +324,14 @@ Chunk::chopString(UString s)
 }
 
 void
-Chunk::writeString(UString s, UFILE* out)
+Chunk::writeString(UString s, OutputWriter* out)
 {
   if(out == NULL) cerr << s;
-  else write(s, out);
+  else out->write(s);
 }
 
 void
-Chunk::writeTreePlain(UFILE* out, int depth)
+Chunk::writeTreePlain(OutputWriter* out, int depth)
 {
   if(depth > 0 && isBlank) return;
   UString base;
@@ -429,7 +376,7 @@ Chunk::writeTreePlain(UFILE* out, int depth)
 }
 
 void
-Chunk::writeTreeLatex(UFILE* out)
+Chunk::writeTreeLatex(OutputWriter* out)
 {
   if(isBlank) return;
   UString nl = " \\\\ "_u;
@@ -475,7 +422,7 @@ Chunk::writeTreeLatex(UFILE* out)
 }
 
 UString
-Chunk::writeTreeDot(UFILE* out)
+Chunk::writeTreeDot(OutputWriter* out)
 {
   if(isBlank) return ""_u;
   static int nodeId = 0;
@@ -3,6 +3,8 @@
 
 #include <rtx_config.h>
 #include <apertium/apertium_re.h>
+#include <output_writer.h>
+#include <pool.h>
 
 #include <vector>
 #include <string>
@@ -82,43 +84,112 @@ public:
     rule = other.rule;
     return *this;
   }
+  /**
+   * Return to the state of a default-constructed Chunk,
+   * but keep the storage of the strings and contents
+   * Pooled Chunks are reset this way, so that a pool which has been
+   * through a few sentences rarely needs to allocate strings
+   */
+  void recycle()
+  {
+    source.clear();
+    target.clear();
+    coref.clear();
+    wblank.clear();
+    isBlank = false;
+    isJoiner = false;
+    contents.clear();
+    rule = -1;
+  }
   Chunk* copy()
   {
     Chunk* ret = new Chunk();
+    copyInto(ret);
+    return ret;
+  }
+  /**
+   * Make ret a shallow copy of this chunk (other than rule)
+   * Assigning rather than constructing lets a recycled ret reuse its storage
+   */
+  void copyInto(Chunk* ret)
+  {
     ret->isBlank = isBlank;
     ret->isJoiner = isJoiner;
     ret->source = source;
     ret->target = target;
     ret->coref = coref;
     ret->wblank = wblank;
-    ret->contents.reserve(contents.size());
-    for(unsigned int i = 0, limit = contents.size(); i < limit; i++)
-    {
-      ret->contents.push_back(contents[i]);
-    }
-    return ret;
+    ret->contents.assign(contents.begin(), contents.end());
   }
   
   UString chunkPart(ApertiumRE const &part, const ClipType side);
   void setChunkPart(ApertiumRE const &part, UString const &value);
   vector<UString> getTags(const vector<UString>& parentTags);
   void updateTags(const vector<UString>& parentTags);
-  void output(const vector<UString>& parentTags, UFILE* out);
-  void output(UFILE* out);
+  void output(const vector<UString>& parentTags, OutputWriter* out);
+  void output(OutputWriter* out);
   UString matchSurface();
   void appendChild(Chunk* kid);
   void conjoin(Chunk* other);
-  void writeTree(TreeMode mode, UFILE* out);
+  void writeTree(TreeMode mode, OutputWriter* out);
   
 private:
+  /**
+   * Call f(start, end, ref) for each tag in target, where [start, end)
+   * includes the angle brackets and ref is n for a reference <n> to the
+   * parent's tags, or -1 for an ordinary tag
+   * getTags() and updateTags() share this, so that neither needs
+   * to build substrings to find the tags
+   */
+  template<typename F>
+  void forEachTag(F f)
+  {
+    for(unsigned int i = 0, limit = target.size(); i < limit; i++)
+    {
+      if(target[i] == '\\')
+      {
+        i++;
+      }
+      else if(target[i] == '<')
+      {
+        int ref = 0;
+        for(unsigned int j = i+1; j < limit; j++)
+        {
+          if(target[j] == '>')
+          {
+            f(i, j+1, ref);
+            i = j;
+            break;
+          }
+          if(ref != -1 && target[j] >= '0' && target[j] <= '9')
+          {
+            ref = (ref < 100000 ? ref*10 + (target[j] - '0') : ref);
+          }
+          else
+          {
+            ref = -1;
+          }
+        }
+      }
+    }
+  }
   static pair<UString, UString> chopString(UString s);
-  static void writeString(UString s, UFILE* out);
-  void writeTreePlain(UFILE* out, int depth);
-  void writeTreeLatex(UFILE* out);
-  UString writeTreeDot(UFILE* out);
+  static void writeString(UString s, OutputWriter* out);
+  void writeTreePlain(OutputWriter* out, int depth);
+  void writeTreeLatex(OutputWriter* out);
+  UString writeTreeDot(OutputWriter* out);
   vector<vector<UString>> writeTreeBox();
 };
 
+template<>
+struct PoolRecycler<Chunk>
+{
+  static void recycle(Chunk* c)
+  {
+    c->recycle();
+  }
+};
+
 /**
  * Combines two wordbound blanks and returns it
 */
@@ -0,0 +1,158 @@
+#include <rtx_config.h>
+#include <compiled_grammar.h>
+#include <bytecode.h>
+#include <lttoolbox/compression.h>
+#include <lttoolbox/string_utils.h>
+
+#include <iostream>
+#include <stdexcept>
+
+using namespace std;
+
+CompiledGrammar::CompiledGrammar()
+{}
+
+CompiledGrammar::~CompiledGrammar()
+{
+  delete mx;
+}
+
+void
+CompiledGrammar::read(string const &filename)
+{
+  FILE *in = fopen(filename.c_str(), "rb");
+  if(in == NULL)
+  {
+    throw runtime_error("Unable to open file " + filename);
+  }
+
+  longestPattern = 2*Compression::multibyte_read(in) - 1;
+  int count = Compression::multibyte_read(in);
+  pat_size.reserve(count);
+  rule_map.reserve(count);
+  for(int i = 0; i < count; i++)
+  {
+    pat_size.push_back(Compression::multibyte_read(in));
+    rule_map.push_back(Compression::string_read(in));
+  }
+  sharableRules.reserve(count);
+  for(auto& rule : rule_map)
+  {
+    bool sharable = true;
+    for(unsigned int i = 0; i < rule.size() && sharable; i++)
+    {
+      switch(rule[i])
+      {
+        case STRING: i += rule[i+1] + 1; break;
+        case INT:
+        case JUMP:
+        case JUMPONTRUE:
+        case JUMPONFALSE: i++; break;
+        case LONGJUMP: i += 2; break;
+        case FETCHVAR:
+        case FETCHCHUNK:
+        case SETCHUNK: sharable = false; break;
+        default: break;
+      }
+    }
+    sharableRules.push_back(sharable);
+  }
+  count = Compression::multibyte_read(in);
+  output_rules.reserve(count);
+  for(int i = 0; i < count; i++)
+  {
+    output_rules.push_back(Compression::string_read(in));
+  }
+
+  varCount = Compression::multibyte_read(in);
+
+  alphabet.read(in);
+
+  Transducer* t = new Transducer();
+  t->read(in, alphabet.size()); 
+
+  multimap<int, pair<int, double>> finals;
+
+  map<int, double> finalWeights = t->getFinals();
+
+  // finals
+  for(int i = 0, limit = Compression::multibyte_read(in); i != limit; i++)
+  {
+    int key = Compression::multibyte_read(in);
+    int rl = Compression::multibyte_read(in);
+    double wgt = Compression::long_multibyte_read(in);
+    finals.insert(make_pair(key, make_pair(rl, wgt)));
+  }
+
+  mx = new MatchExe2(*t, &alphabet, finals, pat_size);
+
+  delete t;
+
+  // attr_items
+  bool recompile_attrs = !Compression::string_read(in).empty();
+  for(int i = 0, limit = Compression::multibyte_read(in); i != limit; i++)
+  {
+    UString const cad_k = Compression::string_read(in);
+    attr_items[cad_k].read(in);
+    UString fallback = Compression::string_read(in);
+    if (recompile_attrs && cad_k == "chname"_u) {
+      // chname was previously "({([^/]+)\\/)"
+      // which was fine for PCRE, but ICU chokes on the unmatched bracket
+      fallback = "(\\{([^/]+)\\/)"_u;
+    }
+    attr_items[cad_k].compile(fallback);
+  }
+
+  // variables
+  for(int i = 0, limit = Compression::multibyte_read(in); i != limit; i++)
+  {
+    UString const cad_k = Compression::string_read(in);
+    variables[cad_k] = Compression::string_read(in);
+  }
+
+  // lists
+  for(int i = 0, limit = Compression::multibyte_read(in); i != limit; i++)
+  {
+    UString const cad_k = Compression::string_read(in);
+
+    for(int j = 0, limit2 = Compression::multibyte_read(in); j != limit2; j++)
+    {
+      UString const cad_v = Compression::string_read(in);
+      lists[cad_k].insert(cad_v);
+      listslow[cad_k].insert(StringUtils::tolower(cad_v));
+    }
+  }
+
+  int nameCount = Compression::multibyte_read(in);
+  for(int i = 0; i < nameCount; i++)
+  {
+    inRuleNames.push_back(Compression::string_read(in));
+  }
+  nameCount = Compression::multibyte_read(in);
+  for(int i = 0; i < nameCount; i++)
+  {
+    outRuleNames.push_back(Compression::string_read(in));
+  }
+
+  bool truncated = feof(in) || ferror(in);
+  fclose(in);
+  if(truncated)
+  {
+    throw runtime_error("Unable to read bytecode from " + filename);
+  }
+}
+
+const ApertiumRE&
+CompiledGrammar::getAttr(const UString& name) const
+{
+  auto it = attr_items.find(name);
+  return (it == attr_items.end() ? emptyAttr : it->second);
+}
+
+const set<UString>&
+CompiledGrammar::getList(const UString& name, bool lower) const
+{
+  const map<UString, set<UString>>& source = (lower ? listslow : lists);
+  auto it = source.find(name);
+  return (it == source.end() ? emptyList : it->second);
+}
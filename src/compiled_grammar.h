@@ -0,0 +1,174 @@
+#ifndef __RTXCOMPILEDGRAMMAR__
+#define __RTXCOMPILEDGRAMMAR__
+
+#include <rtx_config.h>
+#include <apertium/apertium_re.h>
+#include <lttoolbox/alphabet.h>
+#include <matcher.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Everything read from a bytecode file
+ * Nothing is modified after read(), so a single instance can be shared
+ * by any number of RTXProcessors, including on different threads
+ */
+class CompiledGrammar
+{
+private:
+  /**
+   * Alphabet instance for the pattern transducer
+   */
+  Alphabet alphabet;
+
+  /**
+   * The pattern transducer
+   */
+  MatchExe2* mx = NULL;
+
+  /**
+   * Attribute category regular expressions
+   */
+  map<UString, ApertiumRE> attr_items;
+
+  /**
+   * Initial values of global variables
+   * name => value
+   */
+  map<UString, UString> variables;
+
+  /**
+   * Lists
+   * name => { values }
+   */
+  map<UString, set<UString>> lists;
+
+  /**
+   * Lists, but all values are converted to lower case
+   * Used for case-insensitive comparison
+   * name => { values }
+   */
+  map<UString, set<UString>> listslow;
+
+  /**
+   * Bytecode for input-time rules
+   */
+  vector<UString> rule_map;
+
+  /**
+   * Bytecode for output-time rules
+   */
+  vector<UString> output_rules;
+
+  /**
+   * Debug names for input-time rules (may be empty)
+   */
+  vector<UString> inRuleNames;
+
+  /**
+   * Debug names for output-time rules (may be empty)
+   */
+  vector<UString> outRuleNames;
+
+  /**
+   * Whether each input-time rule can have its results shared between
+   * branches, which is true unless it reads global variables
+   * or sets chunk variables
+   */
+  vector<bool> sharableRules;
+
+  /**
+   * Length of pattern of each input-time rule, including blanks
+   */
+  vector<int> pat_size;
+
+  /**
+   * Maximum value of pat_size
+   */
+  unsigned int longestPattern = 0;
+
+  /**
+   * Number of Chunk* global variables
+   */
+  unsigned int varCount = 0;
+
+  /**
+   * Returned by getAttr() and getList() for undefined names
+   */
+  ApertiumRE emptyAttr;
+  set<UString> emptyList;
+public:
+  CompiledGrammar();
+  ~CompiledGrammar();
+  CompiledGrammar(const CompiledGrammar&) = delete;
+  CompiledGrammar& operator=(const CompiledGrammar&) = delete;
+
+  /**
+   * Load a bytecode file
+   * Throws std::runtime_error if it can't be opened or ends early
+   */
+  void read(string const &filename);
+
+  const MatchExe2* matcher() const
+  {
+    return mx;
+  }
+
+  /**
+   * Look up an attribute category or list without inserting it
+   * Undefined names give emptyAttr or emptyList
+   */
+  const ApertiumRE& getAttr(const UString& name) const;
+  const set<UString>& getList(const UString& name, bool lower) const;
+
+  /**
+   * Input-time rules are numbered from 1, output-time rules from 0
+   */
+  unsigned int inputRuleCount() const
+  {
+    return rule_map.size();
+  }
+  const UString& inputRule(int rule) const
+  {
+    return rule_map[rule-1];
+  }
+  const UString& outputRule(int rule) const
+  {
+    return output_rules[rule];
+  }
+  const vector<UString>& inputRuleNames() const
+  {
+    return inRuleNames;
+  }
+  const vector<UString>& outputRuleNames() const
+  {
+    return outRuleNames;
+  }
+  bool isSharable(int rule) const
+  {
+    return sharableRules[rule-1];
+  }
+  int patternSize(int rule) const
+  {
+    return pat_size[rule-1];
+  }
+  unsigned int getLongestPattern() const
+  {
+    return longestPattern;
+  }
+  unsigned int getVarCount() const
+  {
+    return varCount;
+  }
+  const map<UString, UString>& initialVariables() const
+  {
+    return variables;
+  }
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include <chunk.h>
 #include <list>
 #include <cstring>
+#include <unordered_map>
 
 using namespace std;
 
@@ -26,8 +27,10 @@ private:
 public:
   int rule_begin; // region of array in MatchExe2 which
   int rule_end;   // corresponds to this node
+  int lookahead;  // destination of <LOOK:AHEAD>, or -1
+  bool blank;     // whether there is a transition on a blank
   MatchNode2()
-  : size(0), rule_begin(-1), rule_end(-1)
+  : size(0), rule_begin(-1), rule_end(-1), lookahead(-1), blank(false)
   {}
   void setSize(int const sz)
   {
@@ -43,7 +46,7 @@ public:
     trans[pos].tag = tag;
     trans[pos].dest = dest;
   }
-  int search(int tag)
+  int search(int tag) const
   {
     int left = 0, right = size-1;
     while(left <= right)
@@ -67,6 +70,11 @@ public:
   }
 };
 
+/**
+ * The pattern transducer of a compiled grammar
+ * Matching state is kept by the caller, so one of these can be
+ * shared by any number of threads
+ */
 class MatchExe2
 {
 private:
@@ -75,12 +83,14 @@ private:
   int any_tag;
   int lookahead;
   Alphabet* alpha;
+
+  /**
+   * The tags in alpha, copied when the grammar is loaded so that
+   * branches can be matched on several threads without locking,
+   * since Alphabet makes no promises about concurrent lookups
+   */
+  unordered_map<UString, int> tagSymbols;
   int initial;
-  int rejected[RTXStackSize];
-  int rejectedCount;
-  int prematch[RTXStackSize];
-  int prematchAlt[RTXStackSize];
-  int prematchIdx;
 
   int rule_count;
   int* rule_states;
@@ -88,7 +98,7 @@ private:
   double* rule_weights;
   int* rule_lengths;
 
-  void applySymbol(int const srcNode, int const symbol, int* state, int& last)
+  void applySymbol(int const srcNode, int const symbol, int* state, int& last) const
   {
     int res = nodes[srcNode].search(symbol);
     if(res != -1)
@@ -98,6 +108,15 @@ private:
     }
   }
 
+  /**
+   * Look up a tag in tagSymbols, returning 0 if it is not defined
+   */
+  int tagSymbol(const UString& tag) const
+  {
+    auto it = tagSymbols.find(tag);
+    return (it == tagSymbols.end() ? 0 : it->second);
+  }
+
 public:
   MatchExe2(Transducer& t, Alphabet* a, multimap<int, pair<int, double>> const& rules, vector<int> pattern_size)
   : alpha(a)
@@ -135,11 +154,25 @@ public:
 
     initial = t.getInitial();
 
+    // symbols for multicharacter tags are numbered from -1 downwards
+    UString tag;
+    for(int sym = 1; sym <= a->size(); sym++)
+    {
+      tag.clear();
+      a->getSymbol(tag, -sym);
+      tagSymbols[tag] = -sym;
+    }
+
     any_char = (*a)("<ANY_CHAR>"_u);
     any_tag = (*a)("<ANY_TAG>"_u);
     lookahead = (*a)("<LOOK:AHEAD>"_u);
 
-    prematchIdx = 0;
+    // shouldShift() only needs these two transitions, so look them up once
+    for(auto& it : trns)
+    {
+      nodes[it.first].lookahead = nodes[it.first].search(lookahead);
+      nodes[it.first].blank = (nodes[it.first].search(' ') != -1);
+    }
   }
   ~MatchExe2()
   {
@@ -149,11 +182,11 @@ public:
     delete[] rule_weights;
     delete[] rule_lengths;
   }
-  int getInitial()
+  int getInitial() const
   {
     return initial;
   }
-  void step(int* state, int& first, int& last, int const symbol)
+  void step(int* state, int& first, int& last, int const symbol) const
   {
     int loclast = last;
     for(int i = first; i != loclast; i = (i+1)%RTXStateSize)
@@ -162,7 +195,7 @@ public:
     }
     first = loclast;
   }
-  void step(int* state, int& first, int& last, int const symbol, int const alt)
+  void step(int* state, int& first, int& last, int const symbol, int const alt) const
   {
     int loclast = last;
     for(int i = first; i != loclast; i = (i+1)%RTXStateSize)
@@ -172,11 +205,11 @@ public:
     }
     first = loclast;
   }
-  void matchBlank(int* state, int& first, int& last)
+  void matchBlank(int* state, int& first, int& last) const
   {
     step(state, first, last, ' ');
   }
-  void matchChunk(int* state, int& first, int& last, const UString& ch, bool addInit = true)
+  void matchChunk(int* state, int& first, int& last, const UString& ch, bool addInit = true) const
   {
     step(state, first, last, '^');
     if(addInit)
@@ -195,7 +228,7 @@ public:
           {
             if(ch[j] == '>')
             {
-              int symbol = (*alpha)(ch.substr(i, j-i+1));
+              int symbol = tagSymbol(ch.substr(i, j-i+1));
               if(symbol)
               {
                 step(state, first, last, symbol, any_tag);
@@ -216,83 +249,127 @@ public:
     }
     step(state, first, last, '$');
   }
-  void prepareChunk(const UString& chunk)
-  {
-    prematchIdx = 0;
+  /**
+   * Convert the surface of a chunk to the symbols that matchChunk() would
+   * step over, as (symbol, alternative) pairs, so that it can be matched
+   * repeatedly without looking up its tags each time
+   */
+  void prepareSymbols(const UString& chunk, vector<int>& symbols) const
+  {
+    symbols.clear();
     for(unsigned int i = 0, limit = chunk.size(); i < limit; i++)
     {
       switch(chunk[i])
       {
         case '\\':
-          prematchAlt[prematchIdx] = any_char;
-          prematch[prematchIdx++] = towlower(chunk[++i]);
+          symbols.push_back(towlower(chunk[++i]));
+          symbols.push_back(any_char);
           break;
         case '<':
           for(unsigned int j = i+1; j < chunk.size(); j++)
           {
             if(chunk[j] == '>')
             {
-              int symbol = (*alpha)(chunk.substr(i, j-i+1));
-              prematchAlt[prematchIdx] = any_tag;
-              prematch[prematchIdx++] = (symbol ? symbol : any_tag);
+              int symbol = tagSymbol(chunk.substr(i, j-i+1));
+              symbols.push_back(symbol ? symbol : any_tag);
+              symbols.push_back(any_tag);
               i = j;
               break;
             }
           }
           break;
         default:
-          prematchAlt[prematchIdx] = any_char;
-          prematch[prematchIdx++] = towlower(chunk[i]);
+          symbols.push_back(towlower(chunk[i]));
+          symbols.push_back(any_char);
           break;
       }
     }
   }
-  void matchPreparedChunk(int* state, int& first, int& last)
+  void matchSymbols(int* state, int& first, int& last, const vector<int>& symbols) const
   {
-    step(state, first, last, '^');
-    applySymbol(initial, '^', state, last);
-    for(int i = 0; i < prematchIdx; i++)
+    for(unsigned int i = 0; i < symbols.size(); i += 2)
     {
-      if(prematch[i] == any_tag)
+      if(symbols[i] == any_tag)
       {
         step(state, first, last, any_tag);
       }
       else
       {
-        step(state, first, last, prematch[i], prematchAlt[i]);
+        step(state, first, last, symbols[i], symbols[i+1]);
       }
     }
+  }
+  /**
+   * Like matchChunk(), but with symbols from prepareSymbols()
+   */
+  void matchPreparedChunk(int* state, int& first, int& last, const vector<int>& symbols) const
+  {
+    step(state, first, last, '^');
+    applySymbol(initial, '^', state, last);
+    matchSymbols(state, first, last, symbols);
     step(state, first, last, '$');
   }
-  bool shouldShift(int* state, int first, int last)
+  bool shouldShift(int* state, int first, int last) const
   {
     for(int i = first; i != last; i = (i+1)%RTXStateSize)
     {
-      if(nodes[state[i]].search(' ') != -1)
+      if(nodes[state[i]].blank)
       {
         return true;
       }
     }
     return false;
   }
-  bool shouldShift(int* state, int first, int last, const UString& chunk)
+  /**
+   * Step state over <LOOK:AHEAD> into local_state
+   * @return false if no state has a lookahead transition,
+   * in which case nothing can be shifted
+   */
+  bool stepLookahead(int* state, int first, int last, int* local_state, int& local_first, int& local_last) const
+  {
+    local_first = 0;
+    local_last = 0;
+    for(int i = first; i != last; i = (i+1)%RTXStateSize)
+    {
+      if(nodes[state[i]].lookahead != -1)
+      {
+        local_state[local_last++] = nodes[state[i]].lookahead;
+      }
+    }
+    return local_last != 0;
+  }
+  bool shouldShift(int* state, int first, int last, const UString& chunk) const
   {
     int local_state[RTXStateSize];
-    memcpy(local_state, state, RTXStateSize*sizeof(int));
-    int local_first = first;
-    int local_last = last;
-    step(local_state, local_first, local_last, lookahead);
+    int local_first, local_last;
+    if(!stepLookahead(state, first, last, local_state, local_first, local_last))
+    {
+      return false;
+    }
     matchChunk(local_state, local_first, local_last, chunk, false);
     return local_first != local_last;
   }
-  pair<int, double> getRule(int* state, int first, int last)
+  bool shouldShift(int* state, int first, int last, const vector<int>& symbols) const
+  {
+    int local_state[RTXStateSize];
+    int local_first, local_last;
+    if(!stepLookahead(state, first, last, local_state, local_first, local_last))
+    {
+      return false;
+    }
+    step(local_state, local_first, local_last, '^');
+    matchSymbols(local_state, local_first, local_last, symbols);
+    step(local_state, local_first, local_last, '$');
+    return local_first != local_last;
+  }
+  pair<int, double> getRule(int* state, int first, int last, const int* rejected, int rejectedCount) const
   {
     int rule = -1;
     double weight = 0.0;
     int len = 0;
     for(int i = first; i != last; i = (i+1)%RTXStateSize)
     {
-      MatchNode2& node = nodes[state[i]];
+      const MatchNode2& node = nodes[state[i]];
       if(node.rule_begin == -1) continue;
       for(int rl = node.rule_begin; rl <= node.rule_end; rl++)
       {
@@ -323,7 +400,7 @@ public:
     }
     return make_pair(rule, weight);
   }
-  int getRuleUnweighted(int* state, int first, int last)
+  int getRuleUnweighted(int* state, int first, int last) const
   {
     for(int i = first; i != last; i = (i+1)%RTXStateSize)
     {
@@ -334,14 +411,6 @@ public:
     }
     return -1;
   }
-  void resetRejected()
-  {
-    rejectedCount = 0;
-  }
-  void rejectRule(int rule)
-  {
-    rejected[rejectedCount++] = rule;
-  }
 };
 
 class ParseNode
@@ -353,7 +422,7 @@ public:
   Chunk* chunk;
   int length;
   ParseNode* prev;
-  MatchExe2* mx;
+  const MatchExe2* mx;
   double weight;
   int firstWord;
   int lastWord;
@@ -364,7 +433,7 @@ public:
   ParseNode()
   : first(0), last(0), firstWord(0), lastWord(0), id(-1)
   {}
-  void init(MatchExe2* m, Chunk* ch, double w = 0.0)
+  void init(const MatchExe2* m, Chunk* ch, double w = 0.0)
   {
     firstWord = 0;
     lastWord = 0;
@@ -382,7 +451,7 @@ public:
       mx->matchChunk(state, first, last, chunk->matchSurface());
     }
   }
-  void init(ParseNode* prevNode, Chunk* next, double w = 0.0)
+  void init(ParseNode* prevNode, Chunk* next, double w = 0.0, bool copyVars = true)
   {
     chunk = next;
     prev = prevNode;
@@ -394,9 +463,12 @@ public:
     }
     mx = prevNode->mx;
     length = prev->length+1;
-    stringVars = prev->stringVars;
-    wblankVars = prev->wblankVars;
-    chunkVars = prev->chunkVars;
+    if(copyVars)
+    {
+      stringVars = prev->stringVars;
+      wblankVars = prev->wblankVars;
+      chunkVars = prev->chunkVars;
+    }
     weight = (w == 0) ? prev->weight : w;
     if(next->isBlank)
     {
@@ -407,7 +479,11 @@ public:
       mx->matchChunk(state, first, this->last, chunk->matchSurface());
     }
   }
-  void init(ParseNode* prevNode, Chunk* next, bool prepared)
+  /**
+   * Like init(prevNode, next), but matching next by the symbols
+   * MatchExe2::prepareSymbols() gave for it
+   */
+  void init(ParseNode* prevNode, Chunk* next, const vector<int>& symbols, bool copyVars = true)
   {
     chunk = next;
     prev = prevNode;
@@ -420,20 +496,19 @@ public:
     weight = prev->weight;
     firstWord = prev->lastWord+1;
     lastWord = firstWord;
-    stringVars = prev->stringVars;
-    wblankVars = prev->wblankVars;
-    chunkVars = prev->chunkVars;
-    if(next->isBlank)
+    if(copyVars)
     {
-      mx->matchBlank(state, first, last);
+      stringVars = prev->stringVars;
+      wblankVars = prev->wblankVars;
+      chunkVars = prev->chunkVars;
     }
-    else if(prepared)
+    if(next->isBlank)
     {
-      mx->matchPreparedChunk(state, first, last);
+      mx->matchBlank(state, first, last);
     }
     else
     {
-      mx->matchChunk(state, first, last, chunk->matchSurface());
+      mx->matchPreparedChunk(state, first, last, symbols);
     }
   }
   void init(ParseNode* other)
@@ -453,6 +528,16 @@ public:
     wblankVars = other->wblankVars;
     chunkVars = other->chunkVars;
   }
+  /**
+   * Move the variables of other into this node rather than copying them
+   * other must not be used as a branch afterwards
+   */
+  void takeVars(ParseNode* other)
+  {
+    stringVars.swap(other->stringVars);
+    wblankVars.swap(other->wblankVars);
+    chunkVars.swap(other->chunkVars);
+  }
   void getChunks(list<Chunk*>& chls, int count)
   {
     chls.push_front(chunk);
@@ -471,9 +556,9 @@ public:
     if(n == 0) return this;
     return prev->popNodes(n-1);
   }
-  pair<int, double> getRule()
+  pair<int, double> getRule(const vector<int>& rejected)
   {
-    return mx->getRule(state, first, last);
+    return mx->getRule(state, first, last, rejected.data(), rejected.size());
   }
   bool shouldShift()
   {
@@ -483,6 +568,10 @@ public:
   {
     return mx->shouldShift(state, first, last, next->matchSurface());
   }
+  bool shouldShift(const vector<int>& symbols)
+  {
+    return mx->shouldShift(state, first, last, symbols);
+  }
   bool isDone()
   {
     return (first == last);
@@ -0,0 +1,590 @@
+#ifndef __RTXOUTPUTWRITER__
+#define __RTXOUTPUTWRITER__
+
+#include <rtx_config.h>
+#include <binary_stream.h>
+#include <spsc_queue.h>
+#include <lttoolbox/ustring.h>
+#include <unicode/utf8.h>
+#include <unicode/utf16.h>
+
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * When OutputWriter passes its buffer on to the output stream
+ */
+enum FlushPolicy
+{
+  /**
+   * After each parse is output (the default)
+   */
+  FlushEveryUnit,
+  /**
+   * Only at \0 in null flush mode, and at the end of the input
+   */
+  FlushOnNull,
+  /**
+   * Once a given number of bytes are waiting, and at \0
+   */
+  FlushEveryBytes
+};
+
+/**
+ * Buffered UTF-8 output stream
+ * The counterpart of BlockReader: UStrings are encoded directly into
+ * a buffer rather than through the ICU converter that a UFILE would use,
+ * and the buffer is only written out according to the flush policy
+ * Unpaired surrogates are written as U+FFFD
+ * In binary mode, LUs, blanks and nulls are written as records of the
+ * binary stream format, and each run of other text is written as one blank
+ * In background mode, full buffers are handed to a separate thread
+ * which does the actual writing, so that the caller doesn't wait on I/O
+ * Output can also be collected in a string rather than written to a file
+ */
+class OutputWriter
+{
+private:
+  static const size_t MinBufferSize = 1 << 16;
+  /**
+   * FlushEveryBytes doesn't grow the buffer beyond this,
+   * and larger sizes are treated as this size
+   */
+  static const size_t MaxBufferSize = 1 << 26;
+  FILE* out;
+  std::string* dest;
+  std::vector<char> buffer;
+  size_t len;
+  FlushPolicy policy;
+  size_t flushBytes;
+
+  /**
+   * Binary mode state: whether the magic number has been written,
+   * and the ids of the tags defined so far
+   */
+  bool binary;
+  bool wroteMagic;
+  std::unordered_map<UString, unsigned int> tagIds;
+
+  /**
+   * Binary mode: text written since the last record, which is written
+   * as a single blank record before the next one
+   */
+  UString blank;
+
+  /**
+   * Background mode state: buffers waiting to be written,
+   * and the thread that writes them
+   */
+  struct Block
+  {
+    std::vector<char> data;
+    size_t len = 0;
+    bool flush = false;
+    bool stop = false;
+  };
+  SpscQueue<Block>* blocks;
+  std::thread* writer;
+
+  /**
+   * When writing to dest, called with the output of each unit
+   * as soon as it is complete, and where the current unit begins
+   */
+  std::function<void(const char*, size_t)> unitCallback;
+  size_t unitStart;
+
+  /**
+   * Statistics
+   */
+  unsigned long writeCount;
+
+  void put(const char* data, size_t n)
+  {
+    if(dest != NULL)
+    {
+      dest->append(data, n);
+    }
+    else
+    {
+      fwrite_unlocked(data, 1, n, out);
+    }
+  }
+  void reportUnit()
+  {
+    if(unitCallback && dest != NULL)
+    {
+      drain();
+      if(dest->size() > unitStart)
+      {
+        unitCallback(dest->data() + unitStart, dest->size() - unitStart);
+        unitStart = dest->size();
+      }
+    }
+  }
+
+  void writeBlocks()
+  {
+    while(true)
+    {
+      Block& b = blocks->front();
+      if(b.len > 0)
+      {
+        fwrite_unlocked(b.data.data(), 1, b.len, out);
+      }
+      if(b.flush)
+      {
+        fflush(out);
+      }
+      bool stop = b.stop;
+      blocks->pop();
+      if(stop) return;
+    }
+  }
+  /**
+   * Hand the buffer to the writer thread, swapping in
+   * the storage of a block it has finished with
+   */
+  void pushBlock(bool flush, bool stop)
+  {
+    size_t size = buffer.size();
+    Block& b = blocks->startPush();
+    b.data.swap(buffer);
+    b.len = len;
+    b.flush = flush;
+    b.stop = stop;
+    blocks->finishPush();
+    if(buffer.size() < size)
+    {
+      buffer.resize(size);
+    }
+    len = 0;
+  }
+  void drain()
+  {
+    if(len > 0)
+    {
+      if(writer != NULL)
+      {
+        pushBlock(false, false);
+      }
+      else
+      {
+        put(buffer.data(), len);
+        len = 0;
+      }
+      writeCount++;
+    }
+  }
+  void encode(UChar32 c)
+  {
+    if(U_IS_SURROGATE(c))
+    {
+      c = 0xFFFD;
+    }
+    U8_APPEND_UNSAFE(buffer.data(), len, c);
+  }
+  void writeText(const UChar* s, size_t n)
+  {
+    for(size_t i = 0; i < n; i++)
+    {
+      if(len + U8_MAX_LENGTH > buffer.size())
+      {
+        drain();
+      }
+      UChar32 c = s[i];
+      if(c < 0x80)
+      {
+        buffer[len++] = c;
+      }
+      else
+      {
+        if(U16_IS_LEAD(c) && i+1 < n && U16_IS_TRAIL(s[i+1]))
+        {
+          c = U16_GET_SUPPLEMENTARY(c, s[++i]);
+        }
+        encode(c);
+      }
+    }
+  }
+  void putByte(unsigned char b)
+  {
+    if(len == buffer.size())
+    {
+      drain();
+    }
+    buffer[len++] = b;
+  }
+  void putNumber(size_t n)
+  {
+    while(n >= 0x80)
+    {
+      putByte((n & 0x7F) | 0x80);
+      n >>= 7;
+    }
+    putByte(n);
+  }
+  static size_t utf8Length(const UChar* s, size_t n)
+  {
+    size_t ret = 0;
+    for(size_t i = 0; i < n; i++)
+    {
+      if(s[i] < 0x80) ret += 1;
+      else if(s[i] < 0x800) ret += 2;
+      else if(U16_IS_LEAD(s[i]) && i+1 < n && U16_IS_TRAIL(s[i+1]))
+      {
+        ret += 4;
+        i++;
+      }
+      else ret += 3;
+    }
+    return ret;
+  }
+  void startRecord(BinaryRecord kind)
+  {
+    if(!wroteMagic)
+    {
+      writeBytes(BinaryStreamMagic, BinaryStreamMagicLength);
+      wroteMagic = true;
+    }
+    putByte(kind);
+  }
+  void putPlain(const UChar* s, size_t n)
+  {
+    putNumber(utf8Length(s, n));
+    writeText(s, n);
+  }
+  void putBlank()
+  {
+    if(!blank.empty())
+    {
+      startRecord(BinaryBlank);
+      putPlain(blank.data(), blank.size());
+      blank.clear();
+    }
+  }
+  void putRecord(BinaryRecord kind)
+  {
+    putBlank();
+    startRecord(kind);
+  }
+  /**
+   * Call f(start, end) for each tag in s, as Chunk::forEachTag() does
+   */
+  template<typename F>
+  static void forEachTag(const UString& s, F f)
+  {
+    for(size_t i = 0; i < s.size(); i++)
+    {
+      if(s[i] == '\\')
+      {
+        i++;
+      }
+      else if(s[i] == '<')
+      {
+        size_t j = s.find('>', i+1);
+        if(j == UString::npos) return;
+        f(i, j+1);
+        i = j;
+      }
+    }
+  }
+  /**
+   * Write records for any tags in s that don't have ids yet
+   */
+  void defineTags(const UString& s)
+  {
+    forEachTag(s, [&](size_t start, size_t end) {
+      if(tagIds.size() >= BinaryStreamMaxTags) return;
+      UString tag = s.substr(start, end-start);
+      if(tagIds.find(tag) == tagIds.end())
+      {
+        unsigned int id = tagIds.size();
+        tagIds[tag] = id;
+        putRecord(BinaryTag);
+        putPlain(tag.data(), tag.size());
+      }
+    });
+  }
+  void putTagged(const UString& s)
+  {
+    size_t last = 0;
+    UString tag;
+    forEachTag(s, [&](size_t start, size_t end) {
+      tag.assign(s, start, end-start);
+      auto it = tagIds.find(tag);
+      if(it == tagIds.end()) return;
+      if(start > last)
+      {
+        putNumber(2*utf8Length(s.data() + last, start-last));
+        writeText(s.data() + last, start-last);
+      }
+      putNumber(2*it->second + 1);
+      last = end;
+    });
+    if(last < s.size())
+    {
+      putNumber(2*utf8Length(s.data() + last, s.size()-last));
+      writeText(s.data() + last, s.size()-last);
+    }
+    putNumber(0);
+  }
+public:
+  OutputWriter(FILE* f)
+  : out(f), dest(NULL), buffer(MinBufferSize), len(0), policy(FlushEveryUnit),
+    flushBytes(0), binary(false), wroteMagic(false), blocks(NULL),
+    writer(NULL), unitStart(0), writeCount(0)
+  {}
+  /**
+   * Append the output to d, which must outlive the writer
+   * Background mode can't be used
+   */
+  OutputWriter(std::string* d)
+  : out(NULL), dest(d), buffer(MinBufferSize), len(0), policy(FlushEveryUnit),
+    flushBytes(0), binary(false), wroteMagic(false), blocks(NULL),
+    writer(NULL), unitStart(d->size()), writeCount(0)
+  {}
+  ~OutputWriter()
+  {
+    if(len > 0 || !blank.empty())
+    {
+      flush();
+    }
+    setBackground(false);
+  }
+  FILE* file()
+  {
+    return out;
+  }
+  /**
+   * @param bytes - with FlushEveryBytes, how much output to collect
+   */
+  void setFlushPolicy(FlushPolicy p, size_t bytes = 0)
+  {
+    drain();
+    policy = p;
+    flushBytes = (bytes < MaxBufferSize ? bytes : MaxBufferSize);
+    if(policy == FlushEveryBytes && flushBytes > buffer.size())
+    {
+      buffer.resize(flushBytes);
+    }
+  }
+  /**
+   * Start or stop the writer thread
+   * Stopping it waits for everything to be written, and must happen
+   * before the output stream is closed
+   */
+  void setBackground(bool val)
+  {
+    if(val && writer == NULL)
+    {
+      drain();
+      blocks = new SpscQueue<Block>(8);
+      writer = new std::thread(&OutputWriter::writeBlocks, this);
+    }
+    else if(!val && writer != NULL)
+    {
+      pushBlock(true, true);
+      writer->join();
+      delete writer;
+      delete blocks;
+      writer = NULL;
+      blocks = NULL;
+    }
+  }
+  bool isBackground() const
+  {
+    return writer != NULL;
+  }
+  /**
+   * When writing to a string, call f with the output of each parse
+   * and each null-flushed segment, and with anything left on flush(),
+   * so that together the calls cover the whole output
+   */
+  void setUnitCallback(std::function<void(const char*, size_t)> f)
+  {
+    unitCallback = f;
+  }
+  void setBinary(bool val)
+  {
+    binary = val;
+  }
+  bool isBinary() const
+  {
+    return binary;
+  }
+  unsigned long writes() const
+  {
+    return writeCount;
+  }
+  void put(UChar32 c)
+  {
+    if(binary)
+    {
+      if(c <= 0xFFFF)
+      {
+        blank += (UChar)c;
+      }
+      else
+      {
+        blank += (UChar)U16_LEAD(c);
+        blank += (UChar)U16_TRAIL(c);
+      }
+      return;
+    }
+    if(len + U8_MAX_LENGTH > buffer.size())
+    {
+      drain();
+    }
+    if(c < 0x80)
+    {
+      buffer[len++] = c;
+    }
+    else
+    {
+      encode(c);
+    }
+  }
+  /**
+   * Write text which is not part of an LU
+   */
+  void write(const UChar* s, size_t n)
+  {
+    if(binary)
+    {
+      blank.append(s, n);
+    }
+    else
+    {
+      writeText(s, n);
+    }
+  }
+  void write(const UString& s)
+  {
+    write(s.data(), s.size());
+  }
+  /**
+   * Write an LU, omitting trailing empty fields
+   */
+  void writeWord(const UString& wblank, const UString& source,
+                 const UString& target = UString(), const UString& coref = UString())
+  {
+    if(binary)
+    {
+      defineTags(source);
+      defineTags(target);
+      defineTags(coref);
+      putRecord(BinaryWord);
+      putPlain(wblank.data(), wblank.size());
+      putTagged(source);
+      putTagged(target);
+      putTagged(coref);
+      return;
+    }
+    writeText(wblank.data(), wblank.size());
+    putByte('^');
+    writeText(source.data(), source.size());
+    if(!target.empty() || !coref.empty())
+    {
+      putByte('/');
+      writeText(target.data(), target.size());
+    }
+    if(!coref.empty())
+    {
+      putByte('/');
+      writeText(coref.data(), coref.size());
+    }
+    putByte('$');
+  }
+  /**
+   * Write \0, for null flush mode
+   */
+  void writeNull()
+  {
+    if(binary)
+    {
+      putRecord(BinaryNull);
+    }
+    else
+    {
+      putByte('\0');
+    }
+  }
+  /**
+   * Write bytes which are already UTF-8
+   */
+  void writeBytes(const char* data, size_t n)
+  {
+    if(len + n > buffer.size())
+    {
+      drain();
+      if(n >= buffer.size() && writer == NULL)
+      {
+        put(data, n);
+        writeCount++;
+        return;
+      }
+      else if(n > buffer.size())
+      {
+        buffer.resize(n);
+      }
+    }
+    memcpy(buffer.data() + len, data, n);
+    len += n;
+  }
+  /**
+   * Write out everything regardless of the policy
+   * Used at the end of the input and to keep traces on stderr in order
+   */
+  void flush()
+  {
+    putBlank();
+    if(writer != NULL)
+    {
+      if(len > 0)
+      {
+        writeCount++;
+      }
+      pushBlock(true, false);
+      return;
+    }
+    drain();
+    if(out != NULL)
+    {
+      fflush(out);
+    }
+    reportUnit();
+  }
+  /**
+   * The output of a parse is complete
+   */
+  void endUnit()
+  {
+    putBlank();
+    if(policy == FlushEveryUnit ||
+       (policy == FlushEveryBytes && len >= flushBytes))
+    {
+      flush();
+    }
+    else
+    {
+      reportUnit();
+    }
+  }
+  /**
+   * End a null-flushed segment by writing \0 and flushing
+   * This always flushes, since whoever is on the other end of the pipe
+   * is waiting for it
+   */
+  void endSegment()
+  {
+    writeNull();
+    flush();
+  }
+};
+
+#endif
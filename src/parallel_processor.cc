@@ -0,0 +1,185 @@
+#include <rtx_config.h>
+#include <parallel_processor.h>
+
+#include <iostream>
+#include <thread>
+
+ParallelProcessor::ParallelProcessor(const vector<RTXProcessor*>& procs)
+: workers(procs), infile(""), maxPending(4*procs.size())
+{}
+
+bool
+ParallelProcessor::readUnit(string& dest)
+{
+  if(inputEnded)
+  {
+    return false;
+  }
+  dest.clear();
+  if(nullFlush)
+  {
+    // process() treats the end of the input as one last segment,
+    // even if it's empty
+    segments.readSegment(dest);
+    dest += '\0';
+    inputEnded = segments.eof();
+    return true;
+  }
+  bool inword = false;
+  bool inblank = false;
+  size_t wordStart = 0;
+  int c;
+  while((c = infile.getByte()) != -1)
+  {
+    dest += (char)c;
+    if(c == '\\')
+    {
+      c = infile.getByte();
+      if(c == -1) break;
+      dest += (char)c;
+    }
+    else if(inword)
+    {
+      if(c == '$')
+      {
+        inword = false;
+        if(!unitTag.empty() && dest.find(unitTag, wordStart) != string::npos)
+        {
+          return true;
+        }
+      }
+    }
+    else if(inblank)
+    {
+      inblank = (c != ']');
+    }
+    else if(c == '[')
+    {
+      inblank = true;
+    }
+    else if(c == '^')
+    {
+      inword = true;
+      wordStart = dest.size();
+    }
+  }
+  inputEnded = true;
+  return !dest.empty();
+}
+
+void
+ParallelProcessor::readUnits()
+{
+  while(true)
+  {
+    Unit* unit = new Unit();
+    if(!readUnit(unit->input))
+    {
+      delete unit;
+      break;
+    }
+    unique_lock<mutex> guard(lock);
+    spaceFree.wait(guard, [&]{ return pending.size() < maxPending; });
+    pending.push_back(unit);
+    waiting.push_back(unit);
+    workReady.notify_one();
+  }
+  lock_guard<mutex> guard(lock);
+  finished = true;
+  workReady.notify_all();
+  unitDone.notify_all();
+}
+
+void
+ParallelProcessor::work(RTXProcessor* proc)
+{
+  while(true)
+  {
+    Unit* unit;
+    {
+      unique_lock<mutex> guard(lock);
+      workReady.wait(guard, [&]{ return finished || !waiting.empty(); });
+      if(waiting.empty())
+      {
+        return;
+      }
+      unit = waiting.front();
+      waiting.pop_front();
+    }
+    proc->resetVariables();
+    proc->processUnit(unit->input, unit->output);
+    string().swap(unit->input);
+    {
+      lock_guard<mutex> guard(lock);
+      unit->done = true;
+    }
+    unitDone.notify_all();
+  }
+}
+
+void
+ParallelProcessor::process(FILE* in, OutputWriter* out)
+{
+  if(nullFlush)
+  {
+    segments.wrap(in);
+  }
+  else
+  {
+    infile.wrap(in);
+  }
+  thread reader(exitOnError, [this]{ readUnits(); });
+  vector<thread> threads;
+  for(auto proc : workers)
+  {
+    threads.push_back(thread(exitOnError, [this, proc]{ work(proc); }));
+  }
+
+  while(true)
+  {
+    Unit* unit;
+    {
+      unique_lock<mutex> guard(lock);
+      unitDone.wait(guard, [&]{
+        return (!pending.empty() && pending.front()->done) ||
+               (finished && pending.empty());
+      });
+      if(pending.empty())
+      {
+        break;
+      }
+      unit = pending.front();
+      pending.pop_front();
+    }
+    spaceFree.notify_one();
+    out->writeBytes(unit->output.data(), unit->output.size());
+    if(nullFlush)
+    {
+      out->endSegment();
+    }
+    else
+    {
+      out->endUnit();
+    }
+    delete unit;
+    unitCount++;
+  }
+
+  reader.join();
+  for(auto& t : threads)
+  {
+    t.join();
+  }
+  out->flush();
+
+  if(printingStats)
+  {
+    for(unsigned int i = 0; i < workers.size(); i++)
+    {
+      cerr << "Worker " << i << ":" << endl;
+      workers[i]->printStatistics();
+    }
+    cerr << "Units: " << unitCount << " on " << workers.size() << " threads" << endl;
+    cerr << "Output writes: " << out->writes() << endl;
+  }
+}
@@ -0,0 +1,119 @@
+#ifndef __RTXPARALLELPROCESSOR__
+#define __RTXPARALLELPROCESSOR__
+
+#include <rtx_config.h>
+#include <rtx_processor.h>
+#include <block_reader.h>
+#include <token_reader.h>
+#include <output_writer.h>
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Runs several RTXProcessors at once on independent pieces of the input
+ * A reader thread splits the input into units, each worker thread
+ * processes one unit at a time with its own RTXProcessor, and the
+ * calling thread writes the output of each unit in input order
+ * Units are null-flushed segments in null flush mode, and otherwise
+ * end after each LU with the tag unitTag, or if there is none,
+ * the whole input is one unit
+ * Global variables are reset at the start of every unit, since which
+ * units a worker saw before is a matter of timing, so the output only
+ * matches that of a single RTXProcessor if no rule sets a global
+ * variable that is read in a later unit
+ */
+class ParallelProcessor
+{
+private:
+  struct Unit
+  {
+    string input;
+    string output;
+    bool done = false;
+  };
+
+  vector<RTXProcessor*> workers;
+  BlockReader infile;
+
+  /**
+   * In null flush mode, splits the input where RTXProcessor would
+   */
+  TokenReader segments;
+  bool nullFlush = false;
+  bool printingStats = false;
+  string unitTag;
+
+  /**
+   * Whether readUnit() has reached the end of the input
+   */
+  bool inputEnded = false;
+
+  /**
+   * Units which have been read but not yet written, in input order,
+   * and those among them which no worker has started on yet
+   * At most maxPending units are held at once, so that a slow unit
+   * doesn't let the reader pull in the entire input
+   */
+  deque<Unit*> pending;
+  deque<Unit*> waiting;
+  size_t maxPending;
+  bool finished = false;
+  mutex lock;
+  condition_variable workReady;
+  condition_variable unitDone;
+  condition_variable spaceFree;
+
+  /**
+   * Statistics
+   */
+  unsigned long unitCount = 0;
+
+  /**
+   * Read the next unit into dest, including the \0 that ends it
+   * in null flush mode
+   * @return false if there is nothing more to process
+   */
+  bool readUnit(string& dest);
+
+  /**
+   * Body of the reader thread
+   */
+  void readUnits();
+
+  /**
+   * Body of each worker thread
+   */
+  void work(RTXProcessor* proc);
+public:
+  /**
+   * @param procs - one configured processor per worker thread,
+   * which must outlive this object
+   */
+  ParallelProcessor(const vector<RTXProcessor*>& procs);
+  void process(FILE* in, OutputWriter* out);
+  void setNullFlush(bool val)
+  {
+    nullFlush = val;
+  }
+  /**
+   * Without null flush mode, split the input after each LU
+   * with the tag tag, such as sent
+   */
+  void setUnitTag(const string& tag)
+  {
+    unitTag = "<" + tag + ">";
+  }
+  void printStats(bool val)
+  {
+    printingStats = val;
+  }
+};
+
+#endif
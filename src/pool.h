@@ -2,9 +2,27 @@
 #define __RTXALLOCATORPOOL__
 
 #include <rtx_config.h>
+#include <cstdlib>
+#include <new>
 #include <vector>
+#include <sys/mman.h>
 
-template<class ElementType, int BucketSize = 64>//1024>
+/**
+ * How Pool::next() prepares an element that has been handed out before
+ * Specialize this for types which can be reset more cheaply than
+ * destroying and reconstructing them, such as by keeping their storage
+ */
+template<class ElementType>
+struct PoolRecycler
+{
+  static void recycle(ElementType* e)
+  {
+    e->~ElementType();
+    new(e) ElementType();
+  }
+};
+
+template<class ElementType, int BucketSize = 64>
 class Pool
 {
 private:
@@ -13,18 +31,87 @@ private:
     ElementType array[BucketSize];
     int inUse;
     int wasUsed;
+    bool fromSlab;
   };
-  vector<Bucket*> bucketList;
+  std::vector<Bucket*> bucketList;
   unsigned int idx;
   Bucket* cur;
+
+  /**
+   * Number of buckets reset() leaves allocated, 0 for no limit
+   */
+  unsigned int retainBuckets;
+
+  /**
+   * Whether new buckets should be carved out of slabs backed by huge pages
+   * Buckets in slabs can't be freed individually, so reset() keeps them all
+   */
+  bool hugePages;
+  std::vector<char*> slabs;
+  size_t slabUsed;
+  size_t slabSize;
+
+  /**
+   * Statistics
+   */
+  unsigned long allocations;
+  unsigned long bucketAllocations;
+  unsigned int peakBuckets;
+
+  static const size_t HugePageSize = 2*1024*1024;
+
+  void* slabAlloc()
+  {
+#ifdef MADV_HUGEPAGE
+    size_t len = (sizeof(Bucket) + alignof(Bucket) - 1) / alignof(Bucket) * alignof(Bucket);
+    if(slabs.empty() || slabUsed + len > slabSize)
+    {
+      size_t size = (len + HugePageSize - 1) / HugePageSize * HugePageSize;
+      char* slab = (char*)aligned_alloc(HugePageSize, size);
+      if(slab == NULL) return NULL;
+      madvise(slab, size, MADV_HUGEPAGE);
+      slabs.push_back(slab);
+      slabUsed = 0;
+      slabSize = size;
+    }
+    void* ret = slabs.back() + slabUsed;
+    slabUsed += len;
+    return ret;
+#else
+    return NULL;
+#endif
+  }
+  Bucket* newBucket()
+  {
+    bucketAllocations++;
+    void* mem = (hugePages ? slabAlloc() : NULL);
+    bool fromSlab = (mem != NULL);
+    if(mem == NULL)
+    {
+      mem = malloc(sizeof(Bucket));
+      if(mem == NULL)
+      {
+        throw std::bad_alloc();
+      }
+    }
+    Bucket* b = new(mem) Bucket;
+    b->inUse = 0;
+    b->wasUsed = 0;
+    b->fromSlab = fromSlab;
+    return b;
+  }
+  void deleteBucket(Bucket* b)
+  {
+    bool fromSlab = b->fromSlab;
+    b->~Bucket();
+    if(!fromSlab) free(b);
+  }
   inline void getNextBucket()
   {
     idx++;
     if(idx == bucketList.size())
     {
-      cur = new Bucket;
-      cur->inUse = 0;
-      cur->wasUsed = 0;
+      cur = newBucket();
       bucketList.push_back(cur);
     }
     else
@@ -32,46 +119,84 @@ private:
       cur = bucketList[idx];
       cur->inUse = 0;
     }
+    if(idx+1 > peakBuckets)
+    {
+      peakBuckets = idx+1;
+    }
   }
 public:
   Pool()
+  : idx(0), retainBuckets(0), hugePages(false), slabUsed(0), slabSize(0),
+    allocations(0), bucketAllocations(0), peakBuckets(1)
   {
-    idx = 0;
-    Bucket* b = new Bucket;
-    b->inUse = 0;
-    b->wasUsed = 0;
-    bucketList.push_back(b);
-    cur = b;
+    cur = newBucket();
+    bucketList.push_back(cur);
   }
   ~Pool()
   {
     while(bucketList.size() > 0)
     {
-      Bucket* cur = bucketList.back();
+      deleteBucket(bucketList.back());
       bucketList.pop_back();
-      delete cur;
+    }
+    for(auto slab : slabs)
+    {
+      free(slab);
     }
   }
   int size()
   {
-    return BucketSize*(bucketList.size()-1) + cur->inUse;
+    return BucketSize*idx + cur->inUse;
   }
+  /**
+   * Make every element available again
+   * Buckets are kept for reuse, up to retainBuckets of them
+   */
   void reset()
   {
-    bucketList[0]->inUse = 0;
-    while(idx > 0)
+    while(retainBuckets > 0 && bucketList.size() > retainBuckets &&
+          !bucketList.back()->fromSlab)
     {
+      deleteBucket(bucketList.back());
       bucketList.pop_back();
-      delete cur;
-      cur = bucketList[--idx];
     }
+    idx = 0;
+    cur = bucketList[0];
+    cur->inUse = 0;
+  }
+  void setRetainBuckets(unsigned int count)
+  {
+    retainBuckets = count;
+  }
+  void setHugePages(bool val)
+  {
+    hugePages = val;
+  }
+  unsigned long allocationCount() const
+  {
+    return allocations;
+  }
+  unsigned long bucketAllocationCount() const
+  {
+    return bucketAllocations;
+  }
+  /**
+   * Largest number of elements that have been allocated at once
+   * (to the nearest bucket)
+   */
+  unsigned long peakSize() const
+  {
+    return (unsigned long)BucketSize*peakBuckets;
   }
   ElementType* next()
   {
+    allocations++;
     if(cur->inUse == BucketSize)
     {
       getNextBucket();
     }
+    // elements are constructed along with their bucket,
+    // so only ones that have been used before need to be reset
     ElementType* ch = &cur->array[cur->inUse++];
     if(cur->inUse > cur->wasUsed)
     {
@@ -79,9 +204,8 @@ public:
     }
     else
     {
-      ch->~ElementType();
+      PoolRecycler<ElementType>::recycle(ch);
     }
-    ch = new(ch) ElementType();
     return ch;
   }
 };
@@ -0,0 +1,61 @@
+#ifndef __RTXRINGBUFFER__
+#define __RTXRINGBUFFER__
+
+#include <rtx_config.h>
+#include <stdexcept>
+#include <string>
+
+/**
+ * Fixed-capacity FIFO queue
+ * Used for the input window of processGLR(), which never holds more than
+ * a handful of tokens, so a list is needlessly expensive
+ */
+template<class ElementType, unsigned int Capacity = 8>
+class RingBuffer
+{
+private:
+  ElementType array[Capacity];
+  unsigned int start;
+  unsigned int count;
+public:
+  RingBuffer()
+  : start(0), count(0)
+  {}
+  unsigned int size() const
+  {
+    return count;
+  }
+  bool empty() const
+  {
+    return count == 0;
+  }
+  void clear()
+  {
+    start = 0;
+    count = 0;
+  }
+  ElementType& front()
+  {
+    return array[start];
+  }
+  ElementType& operator[](unsigned int i)
+  {
+    return array[(start + i) % Capacity];
+  }
+  void push_back(const ElementType& val)
+  {
+    if(count == Capacity)
+    {
+      throw std::runtime_error("RingBuffer capacity of " + std::to_string(Capacity) + " exceeded.");
+    }
+    array[(start + count) % Capacity] = val;
+    count++;
+  }
+  void pop_front()
+  {
+    start = (start + 1) % Capacity;
+    count--;
+  }
+};
+
+#endif
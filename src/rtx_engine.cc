@@ -0,0 +1,114 @@
+#include <rtx_config.h>
+#include <rtx_engine.h>
+#include <rtx_processor.h>
+
+shared_ptr<const CompiledGrammar>
+RTXEngine::loadGrammar(const string& filename)
+{
+  shared_ptr<CompiledGrammar> g = make_shared<CompiledGrammar>();
+  g->read(filename);
+  return g;
+}
+
+RTXEngine::RTXEngine(const string& filename)
+: RTXEngine(loadGrammar(filename))
+{}
+
+RTXEngine::RTXEngine(shared_ptr<const CompiledGrammar> g)
+: grammar(g), proc(new RTXProcessor())
+{
+  proc->setGrammar(grammar);
+  // each input is a complete text, so \0 has no special meaning
+  proc->setNullFlush(false);
+}
+
+RTXEngine::~RTXEngine()
+{
+  delete proc;
+}
+
+void
+RTXEngine::setTrx(bool val)
+{
+  proc->mimicChunker(val);
+}
+
+void
+RTXEngine::setAnaphora(bool val)
+{
+  proc->withoutCoref(!val);
+}
+
+void
+RTXEngine::setMaxPendingTokens(unsigned int val)
+{
+  proc->setMaxPendingTokens(val);
+}
+
+void
+RTXEngine::setMemoryBudget(size_t bytes)
+{
+  proc->setMemoryBudget(bytes);
+}
+
+void
+RTXEngine::setReparseCacheSize(unsigned int val)
+{
+  proc->setReparseCacheSize(val);
+}
+
+void
+RTXEngine::setBranchThreads(unsigned int val)
+{
+  proc->setBranchThreads(val);
+}
+
+void
+RTXEngine::setUnitCallback(function<void(const char*, size_t)> f)
+{
+  unitCallback = f;
+}
+
+void
+RTXEngine::process(const string& input, string& output)
+{
+  output.clear();
+  proc->resetVariables();
+  OutputWriter writer(&output);
+  writer.setFlushPolicy(FlushOnNull);
+  writer.setUnitCallback(unitCallback);
+  proc->processUnit(input, &writer);
+}
+
+string
+RTXEngine::process(const string& input)
+{
+  string output;
+  process(input, output);
+  return output;
+}
+
+vector<string>
+RTXEngine::processBatch(const vector<string>& inputs,
+  const function<void(size_t, const string&)>& done)
+{
+  vector<string> outputs;
+  if(done)
+  {
+    string output;
+    for(size_t i = 0; i < inputs.size(); i++)
+    {
+      process(inputs[i], output);
+      done(i, output);
+    }
+  }
+  else
+  {
+    outputs.resize(inputs.size());
+    for(size_t i = 0; i < inputs.size(); i++)
+    {
+      process(inputs[i], outputs[i]);
+    }
+  }
+  return outputs;
+}
@@ -0,0 +1,88 @@
+#ifndef __RTXENGINE__
+#define __RTXENGINE__
+
+// This is the header installed for programs using libapertium-recursive,
+// so unlike the rest of the source it doesn't include rtx_config.h
+// or anything else that isn't installed
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class CompiledGrammar;
+class RTXProcessor;
+
+/**
+ * In-memory interface to rtx-proc for use as a library
+ * Input and output are UTF-8 in the usual stream format (^...$)
+ * Each input passed to process() or processBatch() is processed
+ * as a complete text, starting from the initial values of global
+ * variables, so the same input always gives the same output
+ * An engine must only be used by one thread at a time, but any number
+ * of engines can share a grammar, for instance one per thread
+ */
+class RTXEngine
+{
+private:
+  std::shared_ptr<const CompiledGrammar> grammar;
+  RTXProcessor* proc;
+  std::function<void(const char*, size_t)> unitCallback;
+public:
+  /**
+   * Read a bytecode file produced by rtx-comp or trx-comp
+   * Throws std::runtime_error if it can't be opened or isn't complete,
+   * as does the constructor which takes a filename
+   */
+  static std::shared_ptr<const CompiledGrammar> loadGrammar(const std::string& filename);
+
+  RTXEngine(const std::string& filename);
+  RTXEngine(std::shared_ptr<const CompiledGrammar> g);
+  ~RTXEngine();
+  RTXEngine(const RTXEngine&) = delete;
+  RTXEngine& operator=(const RTXEngine&) = delete;
+
+  std::shared_ptr<const CompiledGrammar> getGrammar() const
+  {
+    return grammar;
+  }
+
+  /**
+   * Settings corresponding to options of rtx-proc
+   */
+  void setTrx(bool val);                        // -t
+  void setAnaphora(bool val);                   // -a
+  void setMaxPendingTokens(unsigned int val);   // -l
+  void setMemoryBudget(size_t bytes);           // -X
+  void setReparseCacheSize(unsigned int val);   // -W
+  void setBranchThreads(unsigned int val);      // -B
+
+  /**
+   * Call f with the output of each parse as soon as it has been written,
+   * before process() returns
+   * Together the calls for an input cover its whole output
+   */
+  void setUnitCallback(std::function<void(const char*, size_t)> f);
+
+  /**
+   * Throws std::runtime_error if the input is malformed, such as
+   * a wordbound blank not followed by an LU, or a rule fails because
+   * of a problem with the bytecode
+   * The output of that input is then incomplete, but the engine
+   * can go on to process the next one
+   */
+  std::string process(const std::string& input);
+  void process(const std::string& input, std::string& output);
+
+  /**
+   * Process each input in turn, exactly as process() would
+   * If an input throws, processBatch() stops and passes the error on
+   * @param done - if given, called with the index and output of each
+   * input as it finishes, in which case the returned vector is empty
+   */
+  std::vector<std::string> processBatch(const std::vector<std::string>& inputs,
+    const std::function<void(size_t, const std::string&)>& done = nullptr);
+};
+
+#endif
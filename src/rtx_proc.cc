@@ -1,9 +1,42 @@
 #include <rtx_config.h>
 #include <rtx_processor.h>
+#include <parallel_processor.h>
+#include <rtx_server.h>
 #include <lttoolbox/cli.h>
 #include <lttoolbox/file_utils.h>
 #include <lttoolbox/lt_locale.h>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
+#include <stdexcept>
+#include <thread>
+
+/**
+ * Upper limit for -B and -j, which each start that many threads
+ */
+const unsigned long MaxThreads = 1024;
+
+/**
+ * The value of a numeric option, which must be a whole number
+ * from min to max, otherwise exit with a message
+ */
+unsigned long numberArg(const string& val, const char* name,
+                        unsigned long min, unsigned long max)
+{
+  char* end = NULL;
+  errno = 0;
+  unsigned long ret = strtoul(val.c_str(), &end, 10);
+  if (val.empty() || !isdigit((unsigned char)val[0]) || *end != '\0' ||
+      errno != 0 || ret < min || ret > max) {
+    cerr << "\"" << val << "\" is not a valid value for --" << name;
+    cerr << ", which must be a whole number from " << min << " to " << max << "." << endl;
+    exit(EXIT_FAILURE);
+  }
+  return ret;
+}
 
 int main(int argc, char *argv[])
 {
@@ -11,14 +44,33 @@ int main(int argc, char *argv[])
   CLI cli("perform structural transfer", PACKAGE_VERSION);
   cli.add_bool_arg('a', "anaphora", "expect coreference LUs from apertium-anaphora");
   cli.add_bool_arg('b', "both", "print text (use with -T)");
+  cli.add_str_arg('B', "branch-threads", "advance parse branches on N threads", "N");
+  cli.add_bool_arg('c', "constant-memory", "keep memory use bounded however long the input is (default budget 64MB, see -X)");
+  cli.add_str_arg('C', "segment-cache", "with -z, cache the output of up to N repeated segments", "N");
   cli.add_bool_arg('e', "everything", "print a complete trace of execution");
   cli.add_bool_arg('f', "filter-trace", "trace filterParseGraph()");
   cli.add_bool_arg('F', "filter", "filter branches more often");
+  cli.add_bool_arg('i', "binary-input", "read the binary stream format produced by rtx-stream");
+  cli.add_bool_arg('H', "huge-pages", "back allocators with huge pages where available");
+  cli.add_str_arg('j', "jobs", "with -z, process null-flushed segments on N threads, keeping their order; global variables are reset for each, so output can differ from a run without -j", "N");
+  cli.add_str_arg('l', "flush-length", "output the best parse once N words are pending", "N");
+  cli.add_str_arg('L', "flush-time", "output the best parse once words have been pending for MS milliseconds", "MS");
+  cli.add_str_arg('M', "branch-threshold", "with -B, only use threads once there are N branches (default 16)", "N");
+  cli.add_bool_arg('o', "binary-output", "write the binary stream format (convert it back to text with rtx-stream -d)");
+  cli.add_str_arg('O', "output-flush", "flush output after each parse ('unit', default), only at \\0 ('null'), or once N bytes are waiting", "WHEN");
   cli.add_str_arg('m', "mode", "set the mode of tree output, options are 'flat', 'nest', 'latex', 'dot', 'box'", "MODE");
+  cli.add_bool_arg('p', "pipeline", "read input and write output on their own threads, overlapping them with parsing");
+  cli.add_str_arg('P', "pool-retain", "keep up to N buckets per allocator between sentences (default 32, 0 for no limit)", "N");
   cli.add_bool_arg('r', "rules", "print the rules that are being applied");
   cli.add_bool_arg('s', "steps", "print the instructions executed by the stack machine");
+  cli.add_bool_arg('S', "stats", "print cache and flush statistics to stderr when finished");
+  cli.add_str_arg('U', "unit-tag", "with -j and without -z, split the input after each LU tagged TAG (such as sent), so rules can't match across it", "TAG");
+  cli.add_str_arg('u', "server", "load the grammar once and answer requests on the Unix socket SOCKET until interrupted (with -j N, answer N requests at once)", "SOCKET");
   cli.add_bool_arg('t', "trx", "mimic the behavior of apertium-transfer and apertium-interchunk");
   cli.add_bool_arg('T', "tree", "print parse trees rather than apply output rules");
+  cli.add_bool_arg('y', "layer-threads", "with -t, apply each layer of rules on its own thread");
+  cli.add_str_arg('X', "memory-budget", "output the best parse once the pending sentence uses about MB megabytes (or kilobytes, with a K after the number)", "MB");
+  cli.add_str_arg('W', "word-cache", "cache reparses of up to N unparsed words (default 1024, 0 to disable)", "N");
   cli.add_bool_arg('z', "null-flush", "flush output on \\0");
   cli.add_bool_arg('h', "help", "print this message and exit");
   cli.add_file_arg("bytecode_file", false);
@@ -26,37 +78,170 @@ int main(int argc, char *argv[])
   cli.add_file_arg("output_file", true);
   cli.parse_args(argc, argv);
   
-  RTXProcessor p;
-  p.withoutCoref(!cli.get_bools()["anaphora"]);
-  p.completeTrace(cli.get_bools()["everything"]);
-  p.printFilter(cli.get_bools()["filter-trace"]);
-  p.noFiltering(!cli.get_bools()["filter"]);
-  p.printRules(cli.get_bools()["rules"]);
-  p.printSteps(cli.get_bools()["steps"]);
-  p.mimicChunker(cli.get_bools()["trx"]);
-  p.setNullFlush(cli.get_bools()["null-flush"]);
+  auto args = cli.get_strs();
+  // with -j, every worker shares one copy of the grammar
+  shared_ptr<CompiledGrammar> grammar = make_shared<CompiledGrammar>();
+  try {
+    grammar->read(cli.get_files()[0]);
+  } catch (const runtime_error& e) {
+    cerr << e.what() << endl;
+    exit(EXIT_FAILURE);
+  }
+  auto configure = [&](RTXProcessor& p) {
+    p.setGrammar(grammar);
+    p.withoutCoref(!cli.get_bools()["anaphora"]);
+    p.completeTrace(cli.get_bools()["everything"]);
+    p.printFilter(cli.get_bools()["filter-trace"]);
+    p.noFiltering(!cli.get_bools()["filter"]);
+    p.printRules(cli.get_bools()["rules"]);
+    p.printSteps(cli.get_bools()["steps"]);
+    p.mimicChunker(cli.get_bools()["trx"]);
+    p.setNullFlush(cli.get_bools()["null-flush"]);
+    p.printStats(cli.get_bools()["stats"]);
+    p.setPoolHugePages(cli.get_bools()["huge-pages"]);
+    p.setBinaryInput(cli.get_bools()["binary-input"]);
+    p.setConstantMemory(cli.get_bools()["constant-memory"]);
   
-  bool haveB = cli.get_bools()["both"];
-  bool haveT = cli.get_bools()["tree"];
-  p.printTrees(haveT);
-  p.printText(haveB || (!haveT && !haveB));
+    bool haveB = cli.get_bools()["both"];
+    bool haveT = cli.get_bools()["tree"];
+    p.printTrees(haveT);
+    p.printText(haveB || (!haveT && !haveB));
 
-  auto args = cli.get_strs();
-  if (args.find("mode") != args.end()) {
-    auto m = args["mode"][0];
-    if (!p.setOutputMode(m)) {
-      cout << "\"" << m << "\" is not a recognized tree mode. Valid options are \"flat\", \"nest\", \"latex\", \"dot\", and \"box\"." << endl;
-      exit(EXIT_FAILURE);
+    if (args.find("mode") != args.end()) {
+      auto m = args["mode"][0];
+      if (!p.setOutputMode(m)) {
+        cout << "\"" << m << "\" is not a recognized tree mode. Valid options are \"flat\", \"nest\", \"latex\", \"dot\", and \"box\"." << endl;
+        exit(EXIT_FAILURE);
+      }
+    }
+
+    if (args.find("flush-length") != args.end()) {
+      p.setMaxPendingTokens(numberArg(args["flush-length"][0], "flush-length", 1, UINT_MAX));
+    }
+    if (args.find("flush-time") != args.end()) {
+      p.setMaxPendingMillis(numberArg(args["flush-time"][0], "flush-time", 1, UINT_MAX));
+    }
+    if (args.find("memory-budget") != args.end()) {
+      string budget = args["memory-budget"][0];
+      if (!budget.empty() && (budget.back() == 'K' || budget.back() == 'k')) {
+        budget.pop_back();
+        p.setMemoryBudget(numberArg(budget, "memory-budget", 1, SIZE_MAX >> 10) << 10);
+      } else {
+        p.setMemoryBudget(numberArg(budget, "memory-budget", 1, SIZE_MAX >> 20) << 20);
+      }
+    }
+    if (args.find("segment-cache") != args.end()) {
+      p.setSegmentCacheSize(numberArg(args["segment-cache"][0], "segment-cache", 0, UINT_MAX));
+    }
+    if (args.find("word-cache") != args.end()) {
+      p.setReparseCacheSize(numberArg(args["word-cache"][0], "word-cache", 0, UINT_MAX));
+    }
+    if (args.find("pool-retain") != args.end()) {
+      p.setPoolRetainBuckets(numberArg(args["pool-retain"][0], "pool-retain", 0, UINT_MAX));
+    }
+    if (args.find("branch-threads") != args.end()) {
+      p.setBranchThreads(numberArg(args["branch-threads"][0], "branch-threads", 1, MaxThreads));
+    }
+    if (args.find("branch-threshold") != args.end()) {
+      p.setBranchThreshold(numberArg(args["branch-threshold"][0], "branch-threshold", 1, UINT_MAX));
     }
+  };
+
+  bool server = (args.find("server") != args.end());
+  unsigned int jobs = 1;
+  if (args.find("jobs") != args.end()) {
+    jobs = numberArg(args["jobs"][0], "jobs", 1, MaxThreads);
+  } else if (server) {
+    jobs = thread::hardware_concurrency();
+  }
+  auto bools = cli.get_bools();
+  const char* mode = (server ? "--server" : "-j");
+  bool tracing = (bools["everything"] || bools["filter-trace"] || bools["rules"] || bools["steps"]);
+  if ((server || jobs > 1) && (bools["binary-input"] || bools["binary-output"])) {
+    cerr << mode << " can't be used with the binary stream format." << endl;
+    exit(EXIT_FAILURE);
+  }
+  if ((server || jobs > 1) && tracing) {
+    cerr << mode << " can't be used with tracing options." << endl;
+    exit(EXIT_FAILURE);
+  }
+  bool unitTag = (args.find("unit-tag") != args.end());
+  if (unitTag && bools["null-flush"]) {
+    cerr << "-U can't be used with -z, which splits the input at each \\0." << endl;
+    exit(EXIT_FAILURE);
+  }
+  if (!server && jobs > 1 && !bools["null-flush"] && !unitTag) {
+    // without -z, nothing in the input says where it can be split
+    // without changing the output
+    cerr << "-j needs -z, or -U to split the input after a tag such as sent." << endl;
+    exit(EXIT_FAILURE);
+  }
+  vector<RTXProcessor*> procs;
+  for (unsigned int i = 0; i < jobs || i == 0; i++) {
+    procs.push_back(new RTXProcessor());
+    configure(*procs.back());
+    if (server) {
+      // each request is a complete input
+      procs.back()->setNullFlush(false);
+    }
+  }
+
+  if (server) {
+    RTXServer rs(procs);
+    rs.printStats(bools["stats"]);
+    rs.serve(args["server"][0]);
+    for (auto proc : procs) {
+      delete proc;
+    }
+    return EXIT_SUCCESS;
   }
 
-  p.read(cli.get_files()[0]);
   FILE* input = openInBinFile(cli.get_files()[1]);
-  UFILE* output = openOutTextFile(cli.get_files()[2]);
+  FILE* output = openOutBinFile(cli.get_files()[2]);
+  OutputWriter writer(output);
+  writer.setBinary(cli.get_bools()["binary-output"]);
+  if (args.find("output-flush") != args.end()) {
+    auto f = args["output-flush"][0];
+    if (f == "unit") {
+      writer.setFlushPolicy(FlushEveryUnit);
+    } else if (f == "null") {
+      writer.setFlushPolicy(FlushOnNull);
+    } else if (!f.empty() && isdigit((unsigned char)f[0])) {
+      writer.setFlushPolicy(FlushEveryBytes, numberArg(f, "output-flush", 1, UINT_MAX));
+    } else {
+      cerr << "\"" << f << "\" is not a recognized flush policy. Valid options are \"unit\", \"null\", and a number of bytes." << endl;
+      exit(EXIT_FAILURE);
+    }
+  }
 
-  p.process(input, output);
+  if (bools["pipeline"]) {
+    procs[0]->setPipelined(procs.size() == 1);
+    // traces on stderr are kept in order with the output by flushing it
+    writer.setBackground(!tracing);
+  }
+
+  // with -j, the other threads already have a unit of input each
+  procs[0]->setLayerThreads(bools["layer-threads"] && procs.size() == 1);
+
+  exitOnError([&] {
+    if (procs.size() > 1) {
+      ParallelProcessor pp(procs);
+      pp.setNullFlush(bools["null-flush"]);
+      if (unitTag) {
+        pp.setUnitTag(args["unit-tag"][0]);
+      }
+      pp.printStats(bools["stats"]);
+      pp.process(input, &writer);
+    } else {
+      procs[0]->process(input, &writer);
+    }
+  });
+  for (auto proc : procs) {
+    delete proc;
+  }
 
+  writer.setBackground(false);
   fclose(input);
-  u_fclose(output);
+  fclose(output);
   return EXIT_SUCCESS;
 }
@@ -1,119 +1,133 @@
 #include <rtx_config.h>
 #include <rtx_processor.h>
 #include <bytecode.h>
-#include <lttoolbox/compression.h>
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
+#include <stdexcept>
 #include <lttoolbox/string_utils.h>
+#include <sys/resource.h>
 
 using namespace std;
 
 RTXProcessor::RTXProcessor()
+: newBranchId(0)
 {
+  mainContext.chunkPool = &chunkPool;
+  mainContext.parsePool = &parsePool;
+  configurePools();
 }
 
 RTXProcessor::~RTXProcessor()
 {
-  delete mx;
+  clearReparseCache();
+  delete branchThreads;
+  for(auto worker : branchWorkers)
+  {
+    delete worker;
+  }
 }
 
 void
-RTXProcessor::read(string const &filename)
+RTXProcessor::setBranchThreads(unsigned int val)
 {
-  FILE *in = fopen(filename.c_str(), "rb");
-  if(in == NULL)
+  delete branchThreads;
+  branchThreads = NULL;
+  for(auto worker : branchWorkers)
   {
-    cerr << "Unable to open file " << filename.c_str() << endl;
-    exit(EXIT_FAILURE);
+    delete worker;
+  }
+  branchWorkers.clear();
+  if(val > 0)
+  {
+    // the calling thread is the last worker
+    branchThreads = new ThreadPool(val - 1);
+    for(unsigned int i = 0; i < branchThreads->size(); i++)
+    {
+      branchWorkers.push_back(new BranchWorker());
+    }
   }
+  configurePools();
+}
 
-  longestPattern = 2*Compression::multibyte_read(in) - 1;
-  int count = Compression::multibyte_read(in);
-  pat_size.reserve(count);
-  rule_map.reserve(count);
-  for(int i = 0; i < count; i++)
+void
+RTXProcessor::configurePools()
+{
+  vector<ChunkPool*> chunkPools = {&chunkPool, &tokenPool[0], &tokenPool[1],
+                                   &trxLayers[0].chunkPool, &trxLayers[1].chunkPool};
+  vector<ParseNodePool*> parsePools = {&parsePool};
+  for(auto worker : branchWorkers)
   {
-    pat_size.push_back(Compression::multibyte_read(in));
-    rule_map.push_back(Compression::string_read(in));
+    chunkPools.push_back(&worker->chunkPool);
+    parsePools.push_back(&worker->parsePool);
   }
-  count = Compression::multibyte_read(in);
-  output_rules.reserve(count);
-  for(int i = 0; i < count; i++)
+  for(auto pool : chunkPools)
   {
-    output_rules.push_back(Compression::string_read(in));
+    pool->setRetainBuckets(poolRetainBuckets);
+    pool->setHugePages(poolHugePages);
   }
-
-  varCount = Compression::multibyte_read(in);
-
-  alphabet.read(in);
-
-  Transducer* t = new Transducer();
-  t->read(in, alphabet.size()); 
-
-  multimap<int, pair<int, double>> finals;
-
-  map<int, double> finalWeights = t->getFinals();
-
-  // finals
-  for(int i = 0, limit = Compression::multibyte_read(in); i != limit; i++)
+  for(auto pool : parsePools)
   {
-    int key = Compression::multibyte_read(in);
-    int rl = Compression::multibyte_read(in);
-    double wgt = Compression::long_multibyte_read(in);
-    finals.insert(make_pair(key, make_pair(rl, wgt)));
+    pool->setRetainBuckets(poolRetainBuckets);
+    pool->setHugePages(poolHugePages);
   }
+}
 
-  mx = new MatchExe2(*t, &alphabet, finals, pat_size);
-
-  delete t;
-
-  // attr_items
-  bool recompile_attrs = !Compression::string_read(in).empty();
-  for(int i = 0, limit = Compression::multibyte_read(in); i != limit; i++)
+void
+exitOnError(const function<void()>& f)
+{
+  try
   {
-    UString const cad_k = Compression::string_read(in);
-    attr_items[cad_k].read(in);
-    UString fallback = Compression::string_read(in);
-    if (recompile_attrs && cad_k == "chname"_u) {
-      // chname was previously "({([^/]+)\\/)"
-      // which was fine for PCRE, but ICU chokes on the unmatched bracket
-      fallback = "(\\{([^/]+)\\/)"_u;
-    }
-    attr_items[cad_k].compile(fallback);
+    f();
   }
-
-  // variables
-  for(int i = 0, limit = Compression::multibyte_read(in); i != limit; i++)
+  catch(const runtime_error& e)
   {
-    UString const cad_k = Compression::string_read(in);
-    variables[cad_k] = Compression::string_read(in);
+    cerr << e.what() << endl;
+    exit(EXIT_FAILURE);
   }
+}
 
-  // lists
-  for(int i = 0, limit = Compression::multibyte_read(in); i != limit; i++)
+void
+RTXProcessor::resetPools()
+{
+  chunkPool.reset();
+  parsePool.reset();
+  trxLayers[0].chunkPool.reset();
+  trxLayers[1].chunkPool.reset();
+  for(auto worker : branchWorkers)
   {
-    UString const cad_k = Compression::string_read(in);
-
-    for(int j = 0, limit2 = Compression::multibyte_read(in); j != limit2; j++)
-    {
-      UString const cad_v = Compression::string_read(in);
-      lists[cad_k].insert(cad_v);
-      listslow[cad_k].insert(StringUtils::tolower(cad_v));
-    }
+    worker->chunkPool.reset();
+    worker->parsePool.reset();
   }
+}
 
-  int nameCount = Compression::multibyte_read(in);
-  for(int i = 0; i < nameCount; i++)
+void
+RTXProcessor::read(string const &filename)
+{
+  shared_ptr<CompiledGrammar> g = make_shared<CompiledGrammar>();
+  try
   {
-    inRuleNames.push_back(Compression::string_read(in));
+    g->read(filename);
   }
-  nameCount = Compression::multibyte_read(in);
-  for(int i = 0; i < nameCount; i++)
+  catch(const runtime_error& e)
   {
-    outRuleNames.push_back(Compression::string_read(in));
+    cerr << e.what() << endl;
+    exit(EXIT_FAILURE);
   }
+  setGrammar(g);
+}
 
-  fclose(in);
+void
+RTXProcessor::setGrammar(shared_ptr<const CompiledGrammar> g)
+{
+  grammar = g;
+  mx = grammar->matcher();
+  variables = grammar->initialVariables();
+  wblank_variables.clear();
+  clearRuleMemo();
+  ruleMemo.assign(grammar->inputRuleCount(), map<vector<Chunk*>, RuleMemo>());
+  clearReparseCache();
 }
 
 bool
@@ -157,7 +171,7 @@ RTXProcessor::endsWith(UString const &s1, UString const &s2) const
 }
 
 inline bool
-RTXProcessor::popBool()
+ParseContext::popBool()
 {
   if(theStack[stackIdx].mode == 0)
   {
@@ -165,13 +179,14 @@ RTXProcessor::popBool()
   }
   else
   {
-    cerr << "tried to pop bool but mode is " << theStack[stackIdx].mode << endl;
-    exit(1);
+    ostringstream msg;
+    msg << "tried to pop bool but mode is " << theStack[stackIdx].mode;
+    throw runtime_error(msg.str());
   }
 }
 
 inline int
-RTXProcessor::popInt()
+ParseContext::popInt()
 {
   if(theStack[stackIdx].mode == 1)
   {
@@ -179,13 +194,14 @@ RTXProcessor::popInt()
   }
   else
   {
-    cerr << "tried to pop int but mode is " << theStack[stackIdx].mode << endl;
-    exit(1);
+    ostringstream msg;
+    msg << "tried to pop int but mode is " << theStack[stackIdx].mode;
+    throw runtime_error(msg.str());
   }
 }
 
 inline UString
-RTXProcessor::popString()
+ParseContext::popString()
 {
   if(theStack[stackIdx].mode == 2)
   {
@@ -197,13 +213,14 @@ RTXProcessor::popString()
   }
   else
   {
-    cerr << "tried to pop UString but mode is " << theStack[stackIdx].mode << endl;
-    exit(1);
+    ostringstream msg;
+    msg << "tried to pop UString but mode is " << theStack[stackIdx].mode;
+    throw runtime_error(msg.str());
   }
 }
 
 inline void
-RTXProcessor::popString(UString& dest)
+ParseContext::popString(UString& dest)
 {
   if(theStack[stackIdx].mode == 2)
   {
@@ -215,13 +232,14 @@ RTXProcessor::popString(UString& dest)
   }
   else
   {
-    cerr << "tried to pop UString but mode is " << theStack[stackIdx].mode << endl;
-    exit(1);
+    ostringstream msg;
+    msg << "tried to pop UString but mode is " << theStack[stackIdx].mode;
+    throw runtime_error(msg.str());
   }
 }
 
 inline Chunk*
-RTXProcessor::popChunk()
+ParseContext::popChunk()
 {
   if(theStack[stackIdx].mode == 3)
   {
@@ -229,14 +247,15 @@ RTXProcessor::popChunk()
   }
   else
   {
-    cerr << "tried to pop Chunk but mode is " << theStack[stackIdx].mode << endl;
-    cerr << "The most common reason for getting this error is a macro that is missing an else clause." << endl;
-    exit(1);
+    ostringstream msg;
+    msg << "tried to pop Chunk but mode is " << theStack[stackIdx].mode << "\n";
+    msg << "The most common reason for getting this error is a macro that is missing an else clause.";
+    throw runtime_error(msg.str());
   }
 }
 
 inline void
-RTXProcessor::stackCopy(int src, int dest)
+ParseContext::stackCopy(int src, int dest)
 {
   theStack[dest].mode = theStack[src].mode;
   switch(theStack[src].mode)
@@ -270,10 +289,91 @@ RTXProcessor::gettingLemmaFromWord(UString attr)
 }
 
 bool
-RTXProcessor::applyRule(const UString& rule)
+RTXProcessor::applyInputRule(ParseContext& ctx, int rule)
+{
+  if(!sharingRules || !grammar->isSharable(rule) || !ctx.out_wblank.empty() ||
+     printingSteps || printingRules || printingAll)
+  {
+    return applyRule(ctx, grammar->inputRule(rule));
+  }
+  map<vector<Chunk*>, RuleMemo>& memos = ruleMemo[rule-1];
+  auto it = memos.find(ctx.currentInput);
+  if(it != memos.end())
+  {
+    RuleMemo& memo = it->second;
+    sharedRuleCount++;
+    copyMemoOutput(ctx, memo.output, it->first, ctx.currentOutput);
+    for(unsigned int i = 0; i < memo.varWrites.size(); i += 3)
+    {
+      ctx.currentBranch->stringVars[memo.varWrites[i]] = memo.varWrites[i+1];
+      ctx.currentBranch->wblankVars[memo.varWrites[i]] = memo.varWrites[i+2];
+    }
+    ctx.out_wblank = memo.outWblank;
+    return memo.accepted;
+  }
+  if(memos.empty())
+  {
+    ruleMemoUsed.push_back(rule-1);
+  }
+  // SETCLIP can modify ctx.currentInput, so insert before applying
+  RuleMemo& memo = memos[ctx.currentInput];
+  ctx.varWriteLog = &memo.varWrites;
+  memo.accepted = applyRule(ctx, grammar->inputRule(rule));
+  ctx.varWriteLog = NULL;
+  // later rules on this branch can change the chunks it was given,
+  // so the memo keeps its own copies
+  copyMemoOutput(ctx, ctx.currentOutput, ctx.currentInput, memo.output);
+  memo.outWblank = ctx.out_wblank;
+  return memo.accepted;
+}
+
+void
+RTXProcessor::copyMemoOutput(ParseContext& ctx, const vector<Chunk*>& src,
+                             const vector<Chunk*>& input, vector<Chunk*>& dest)
+{
+  dest.clear();
+  for(auto ch : src)
+  {
+    if(find(input.begin(), input.end(), ch) != input.end())
+    {
+      // an input chunk passed through, which every branch shares anyway
+      dest.push_back(ch);
+      continue;
+    }
+    Chunk* copy = ctx.chunkPool->next();
+    ch->copyInto(copy);
+    copy->rule = ch->rule;
+    dest.push_back(copy);
+  }
+}
+
+Chunk*
+RTXProcessor::copyWithWblank(ParseContext& ctx, Chunk* ch)
+{
+  Chunk* copy = ctx.chunkPool->next();
+  ch->copyInto(copy);
+  copy->rule = ch->rule;
+  copy->wblank = ctx.out_wblank;
+  return copy;
+}
+
+void
+RTXProcessor::clearRuleMemo()
+{
+  for(auto rule : ruleMemoUsed)
+  {
+    ruleMemo[rule].clear();
+  }
+  ruleMemoUsed.clear();
+}
+
+bool
+RTXProcessor::applyRule(ParseContext& ctx, const UString& rule)
 {
-  stackIdx = 0;
-  vector<bool> editted = vector<bool>(currentInput.size(), false);
+  ctx.stackIdx = 0;
+  // which elements of currentInput SETCLIP has replaced with copies,
+  // only filled in if the rule uses SETCLIP on its input
+  bool anyEdits = false;
   const UChar* rule_data = rule.data();
   for(uint64_t i = 0, rule_size = rule.size(); i < rule_size; i++)
   {
@@ -281,53 +381,53 @@ RTXProcessor::applyRule(const UString& rule)
     {
       case DROP:
         if(printingSteps) { cerr << "[" << i << "] drop" << endl; }
-        stackIdx--;
+        ctx.stackIdx--;
         break;
       case DUP:
         if(printingSteps) { cerr << "[" << i << "] dup" << endl; }
-        stackCopy(stackIdx, stackIdx+1);
-        stackIdx++;
+        ctx.stackCopy(ctx.stackIdx, ctx.stackIdx+1);
+        ctx.stackIdx++;
         break;
       case OVER:
         if(printingSteps) { cerr << "[" << i << "] over" << endl; }
-        stackCopy(stackIdx-1, stackIdx+1);
-        stackIdx++;
+        ctx.stackCopy(ctx.stackIdx-1, ctx.stackIdx+1);
+        ctx.stackIdx++;
         break;
       case SWAP:
         if(printingSteps) { cerr << "[" << i << "] swap" << endl; }
       {
-        stackCopy(stackIdx, stackIdx+1);
-        stackCopy(stackIdx-1, stackIdx);
-        stackCopy(stackIdx+1, stackIdx-1);
+        ctx.stackCopy(ctx.stackIdx, ctx.stackIdx+1);
+        ctx.stackCopy(ctx.stackIdx-1, ctx.stackIdx);
+        ctx.stackCopy(ctx.stackIdx+1, ctx.stackIdx-1);
       }
         break;
       case STRING:
       {
         if(printingSteps) { cerr << "[" << i << "] string" << endl; }
         int ct = rule_data[++i];
-        stackIdx++;
-        theStack[stackIdx].mode = 2;
-        theStack[stackIdx].s.assign(rule, i+1, ct);
-        //pushStack(rule.substr(i+1, ct));
+        ctx.stackIdx++;
+        ctx.theStack[ctx.stackIdx].mode = 2;
+        ctx.theStack[ctx.stackIdx].s.assign(rule, i+1, ct);
+        //ctx.pushStack(rule.substr(i+1, ct));
         i += ct;
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx].s << endl; }
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx].s << endl; }
       }
         break;
       case INT:
         if(printingSteps) { cerr << "[" << i << "] int " << (int)rule[i+1] << endl; }
-        pushStack((int)rule_data[++i]);
+        ctx.pushStack((int)rule_data[++i]);
         break;
       case PUSHFALSE:
         if(printingSteps) { cerr << "[" << i << "] pushfalse" << endl; }
-        pushStack(false);
+        ctx.pushStack(false);
         break;
       case PUSHTRUE:
         if(printingSteps) { cerr << "[" << i << "] pushtrue" << endl; }
-        pushStack(true);
+        ctx.pushStack(true);
         break;
       case PUSHNULL:
         if(printingSteps) { cerr << "[" << i << "] pushnull" << endl; }
-        pushStack((Chunk*)NULL);
+        ctx.pushStack((Chunk*)NULL);
         break;
       case JUMP:
         if(printingSteps) { cerr << "[" << i << "] jump" << endl; }
@@ -336,7 +436,7 @@ RTXProcessor::applyRule(const UString& rule)
         break;
       case JUMPONTRUE:
         if(printingSteps) { cerr << "[" << i << "] jumpontrue" << endl; }
-        if(!popBool())
+        if(!ctx.popBool())
         {
           i++;
           if(printingSteps) { cerr << " -> false" << endl; }
@@ -350,7 +450,7 @@ RTXProcessor::applyRule(const UString& rule)
         break;
       case JUMPONFALSE:
         if(printingSteps) { cerr << "[" << i << "] jumponfalse" << endl; }
-        if(popBool())
+        if(ctx.popBool())
         {
           i++;
           if(printingSteps) { cerr << " -> true" << endl; }
@@ -373,37 +473,37 @@ RTXProcessor::applyRule(const UString& rule)
       case AND:
         if(printingSteps) { cerr << "[" << i << "] and" << endl; }
       {
-        bool a = popBool();
-        bool b = popBool();
-        pushStack(a && b);
+        bool a = ctx.popBool();
+        bool b = ctx.popBool();
+        ctx.pushStack(a && b);
       }
         break;
       case OR:
         if(printingSteps) { cerr << "[" << i << "] or" << endl; }
       {
-        bool a = popBool();
-        bool b = popBool();
-        pushStack(a || b);
+        bool a = ctx.popBool();
+        bool b = ctx.popBool();
+        ctx.pushStack(a || b);
       }
         break;
       case NOT:
         if(printingSteps) { cerr << "[" << i << "] not" << endl; }
-        theStack[stackIdx].b = !theStack[stackIdx].b;
+        ctx.theStack[ctx.stackIdx].b = !ctx.theStack[ctx.stackIdx].b;
         break;
       case EQUAL:
       case EQUALCL:
         if(printingSteps) { cerr << "[" << i << "] equal" << endl; }
       {
         UString a;
-        popString(a);
+        ctx.popString(a);
         UString b;
-        popString(b);
+        ctx.popString(b);
         if(rule_data[i] == EQUALCL)
         {
           a = StringUtils::tolower(a);
           b = StringUtils::tolower(b);
         }
-        pushStack(a == b);
+        ctx.pushStack(a == b);
         if(printingSteps) { cerr << " -> " << (a == b ? "true" : "false") << endl; }
       }
         break;
@@ -411,15 +511,15 @@ RTXProcessor::applyRule(const UString& rule)
       case ISPREFIXCL:
         if(printingSteps) { cerr << "[" << i << "] isprefix" << endl; }
       {
-        UString substr = popString();
-        UString str = popString();
+        UString substr = ctx.popString();
+        UString str = ctx.popString();
         if(rule[i] == ISPREFIXCL)
         {
-          pushStack(beginsWith(StringUtils::tolower(str), StringUtils::tolower(substr)));
+          ctx.pushStack(beginsWith(StringUtils::tolower(str), StringUtils::tolower(substr)));
         }
         else
         {
-          pushStack(beginsWith(str, substr));
+          ctx.pushStack(beginsWith(str, substr));
         }
       }
         break;
@@ -427,15 +527,15 @@ RTXProcessor::applyRule(const UString& rule)
       case ISSUFFIXCL:
         if(printingSteps) { cerr << "[" << i << "] issuffix" << endl; }
       {
-        UString substr = popString();
-        UString str = popString();
+        UString substr = ctx.popString();
+        UString str = ctx.popString();
         if(rule[i] == ISSUFFIXCL)
         {
-          pushStack(endsWith(StringUtils::tolower(str), StringUtils::tolower(substr)));
+          ctx.pushStack(endsWith(StringUtils::tolower(str), StringUtils::tolower(substr)));
         }
         else
         {
-          pushStack(endsWith(str, substr));
+          ctx.pushStack(endsWith(str, substr));
         }
       }
         break;
@@ -443,20 +543,20 @@ RTXProcessor::applyRule(const UString& rule)
       case HASPREFIXCL:
         if(printingSteps) { cerr << "[" << i << "] hasprefix" << endl; }
       {
-        UString list = popString();
-        UString needle = popString();
-        set<UString>::iterator it, limit;
+        UString list = ctx.popString();
+        UString needle = ctx.popString();
+        set<UString>::const_iterator it, limit;
 
         if(rule[i] == HASPREFIX)
         {
-          it = lists[list].begin();
-          limit = lists[list].end();
+          it = grammar->getList(list, false).begin();
+          limit = grammar->getList(list, false).end();
         }
         else
         {
           needle = StringUtils::tolower(needle);
-          it = listslow[list].begin();
-          limit = listslow[list].end();
+          it = grammar->getList(list, true).begin();
+          limit = grammar->getList(list, true).end();
         }
 
         bool found = false;
@@ -468,27 +568,27 @@ RTXProcessor::applyRule(const UString& rule)
             break;
           }
         }
-        pushStack(found);
+        ctx.pushStack(found);
       }
         break;
       case HASSUFFIX:
       case HASSUFFIXCL:
         if(printingSteps) { cerr << "[" << i << "] hassuffix" << endl; }
       {
-        UString list = popString();
-        UString needle = popString();
-        set<UString>::iterator it, limit;
+        UString list = ctx.popString();
+        UString needle = ctx.popString();
+        set<UString>::const_iterator it, limit;
 
         if(rule[i] == HASSUFFIX)
         {
-          it = lists[list].begin();
-          limit = lists[list].end();
+          it = grammar->getList(list, false).begin();
+          limit = grammar->getList(list, false).end();
         }
         else
         {
           needle = StringUtils::tolower(needle);
-          it = listslow[list].begin();
-          limit = listslow[list].end();
+          it = grammar->getList(list, true).begin();
+          limit = grammar->getList(list, true).end();
         }
 
         bool found = false;
@@ -500,57 +600,63 @@ RTXProcessor::applyRule(const UString& rule)
             break;
           }
         }
-        pushStack(found);
+        ctx.pushStack(found);
       }
         break;
       case ISSUBSTRING:
       case ISSUBSTRINGCL:
         if(printingSteps) { cerr << "[" << i << "] issubstring" << endl; }
       {
-        UString needle = popString();
-        UString haystack = popString();
+        UString needle = ctx.popString();
+        UString haystack = ctx.popString();
         if(rule[i] == ISSUBSTRINGCL)
         {
           needle = StringUtils::tolower(needle);
           haystack = StringUtils::tolower(haystack);
         }
-        pushStack(haystack.find(needle) != UString::npos);
+        ctx.pushStack(haystack.find(needle) != UString::npos);
       }
         break;
       case IN:
       case INCL:
         if(printingSteps) { cerr << "[" << i << "] in" << endl; }
       {
-        UString list = popString();
-        UString str = popString();
+        UString list = ctx.popString();
+        UString str = ctx.popString();
         if(rule[i] == INCL)
         {
           str = StringUtils::tolower(str);
-          set<UString> &myset = listslow[list];
-          pushStack(myset.find(str) != myset.end());
+          const set<UString>& myset = grammar->getList(list, true);
+          ctx.pushStack(myset.find(str) != myset.end());
         }
         else
         {
-          set<UString> &myset = lists[list];
-          pushStack(myset.find(str) != myset.end());
+          const set<UString>& myset = grammar->getList(list, false);
+          ctx.pushStack(myset.find(str) != myset.end());
         }
       }
         break;
       case SETVAR:
         if(printingSteps) { cerr << "[" << i << "] setvar" << endl; }
       {
-        UString var = popString();
-        UString val = popString();
-        currentBranch->stringVars[var] = val;
-        currentBranch->wblankVars[var] = theWblankStack[stackIdx+1];
-        theWblankStack[stackIdx+1].clear();
+        UString var = ctx.popString();
+        UString val = ctx.popString();
+        ctx.currentBranch->stringVars[var] = val;
+        ctx.currentBranch->wblankVars[var] = ctx.theWblankStack[ctx.stackIdx+1];
+        if(ctx.varWriteLog != NULL)
+        {
+          ctx.varWriteLog->push_back(var);
+          ctx.varWriteLog->push_back(val);
+          ctx.varWriteLog->push_back(ctx.theWblankStack[ctx.stackIdx+1]);
+        }
+        ctx.theWblankStack[ctx.stackIdx+1].clear();
         if(printingSteps) { cerr << " -> " << var << " = '" << val << "'" << endl; }
       }
         break;
       case OUTPUT:
         if(printingSteps) { cerr << "[" << i << "] output" << endl; }
       {
-        Chunk* ch = popChunk();
+        Chunk* ch = ctx.popChunk();
         if(ch == NULL) break; // FETCHCHUNK
         if(isLinear && ch->contents.size() == 0)
         {
@@ -564,13 +670,13 @@ RTXProcessor::applyRule(const UString& rule)
             else if((targ[c] == '{' || targ[c] == '$') && word)
             {
               if(targ[c] == '{') chunk = true;
-              Chunk* temp = chunkPool.next();
+              Chunk* temp = ctx.chunkPool->next();
               temp->isBlank = false;
-              temp->target = ch->target.substr(last, c-last);
-              temp->wblank = out_wblank;
-              out_wblank.clear();
-              if(chunk) currentOutput.back()->contents.push_back(temp);
-              else currentOutput.push_back(temp);
+              temp->target.assign(ch->target, last, c-last);
+              temp->wblank = ctx.out_wblank;
+              ctx.out_wblank.clear();
+              if(chunk) ctx.currentOutput.back()->contents.push_back(temp);
+              else ctx.currentOutput.push_back(temp);
               last = c+1;
               word = false;
             }
@@ -578,11 +684,11 @@ RTXProcessor::applyRule(const UString& rule)
             {
               if(c > last)
               {
-                Chunk* temp = chunkPool.next();
+                Chunk* temp = ctx.chunkPool->next();
                 temp->isBlank = true;
-                temp->target = ch->target.substr(last, c-last);
-                if(chunk) currentOutput.back()->contents.push_back(temp);
-                else currentOutput.push_back(temp);
+                temp->target.assign(ch->target, last, c-last);
+                if(chunk) ctx.currentOutput.back()->contents.push_back(temp);
+                else ctx.currentOutput.push_back(temp);
               }
               if(targ[c] == '}') chunk = false;
               last = c+1;
@@ -591,46 +697,48 @@ RTXProcessor::applyRule(const UString& rule)
           }
           if(last == 0 && ch->target.size() != 0)
           {
-            currentOutput.push_back(ch);
+            ctx.currentOutput.push_back(ch);
           }
           else if(last < ch->target.size())
           {
-            Chunk* temp = chunkPool.next();
+            Chunk* temp = ctx.chunkPool->next();
             temp->isBlank = true;
-            temp->target = ch->target.substr(last);
-            currentOutput.push_back(temp);
+            temp->target.assign(ch->target, last);
+            ctx.currentOutput.push_back(temp);
           }
         }
         else
         {
-          ch->wblank = out_wblank;
-          currentOutput.push_back(ch);
-          out_wblank.clear();
+          // ch may be an input chunk shared with other branches,
+          // which may be running on other threads, so change a copy
+          if(ch->wblank != ctx.out_wblank) ch = copyWithWblank(ctx, ch);
+          ctx.currentOutput.push_back(ch);
+          ctx.out_wblank.clear();
         }
       }
         break;
       case OUTPUTALL:
         if(printingSteps) { cerr << "[" << i << "] outputall" << endl; }
-        currentOutput = currentInput;
+        ctx.currentOutput = ctx.currentInput;
         return true;
         break;
       case PUSHINPUT:
         if(printingSteps) { cerr << "[" << i << "] pushinput" << endl; }
       {
-        int loc = popInt();
+        int loc = ctx.popInt();
         int pos = 2*(loc-1);
         Chunk* ch = NULL;
-        if(pos == -2) ch = parentChunk;
-        else if(0 <= pos && pos < (int)currentInput.size()) ch = currentInput[pos];
+        if(pos == -2) ch = ctx.parentChunk;
+        else if(0 <= pos && pos < (int)ctx.currentInput.size()) ch = ctx.currentInput[pos];
         else
         {
           int n = 0;
-          for(unsigned int x = 0; x < currentInput.size(); x++)
+          for(unsigned int x = 0; x < ctx.currentInput.size(); x++)
           {
-            if(!currentInput[x]->isBlank) n++;
+            if(!ctx.currentInput[x]->isBlank) n++;
             if(n == loc)
             {
-              ch = currentInput[x];
+              ch = ctx.currentInput[x];
               break;
             }
           }
@@ -638,145 +746,152 @@ RTXProcessor::applyRule(const UString& rule)
           {
             //cerr << "Clip index is out of bounds." << endl;
             //exit(EXIT_FAILURE);
-            ch = currentInput.back();
+            ch = ctx.currentInput.back();
           }
         }
-        pushStack(ch);
+        ctx.pushStack(ch);
       }
         break;
       case SOURCECLIP:
         if(printingSteps) { cerr << "[" << i << "] sourceclip" << endl; }
       {
         UString part;
-        popString(part);
-        Chunk* ch = popChunk();
-        if(ch == NULL) pushStack("");
+        ctx.popString(part);
+        Chunk* ch = ctx.popChunk();
+        if(ch == NULL) ctx.pushStack("");
         else
         {
           if(gettingLemmaFromWord(part))
           {
-            pushStack(ch->chunkPart(attr_items[part], SourceClip), ch->wblank);
+            ctx.pushStack(ch->chunkPart(grammar->getAttr(part), SourceClip), ch->wblank);
           }
           else
           {
-            pushStack(ch->chunkPart(attr_items[part], SourceClip));
+            ctx.pushStack(ch->chunkPart(grammar->getAttr(part), SourceClip));
           }
         }
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx].s << endl; }
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx].s << endl; }
       }
         break;
       case TARGETCLIP:
         if(printingSteps) { cerr << "[" << i << "] targetclip" << endl; }
       {
         UString part;
-        popString(part);
-        Chunk* ch = popChunk();
-        if(ch == NULL) pushStack("");
+        ctx.popString(part);
+        Chunk* ch = ctx.popChunk();
+        if(ch == NULL) ctx.pushStack("");
         else
         {
           if(gettingLemmaFromWord(part))
           {
-            pushStack(ch->chunkPart(attr_items[part], TargetClip), ch->wblank);
+            ctx.pushStack(ch->chunkPart(grammar->getAttr(part), TargetClip), ch->wblank);
           }
           else
           {
-             pushStack(ch->chunkPart(attr_items[part], TargetClip));
+             ctx.pushStack(ch->chunkPart(grammar->getAttr(part), TargetClip));
           }
         }
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx].s << endl; }
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx].s << endl; }
       }
         break;
       case REFERENCECLIP:
         if(printingSteps) { cerr << "[" << i << "] referenceclip" << endl; }
       {
         UString part;
-        popString(part);
-        Chunk* ch = popChunk();
-        if(ch == NULL) pushStack("");
-        else pushStack(ch->chunkPart(attr_items[part], ReferenceClip));
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx].s << endl; }
+        ctx.popString(part);
+        Chunk* ch = ctx.popChunk();
+        if(ch == NULL) ctx.pushStack("");
+        else ctx.pushStack(ch->chunkPart(grammar->getAttr(part), ReferenceClip));
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx].s << endl; }
       }
         break;
       case SETCLIP:
         if(printingSteps) { cerr << "[" << i << "] setclip" << endl; }
       {
-        int pos = 2*(popInt()-1);
-        UString part = popString();
+        int pos = 2*(ctx.popInt()-1);
+        UString part = ctx.popString();
         if(pos >= 0)
         {
-          if(!editted[pos])
+          if(!anyEdits)
+          {
+            ctx.editted.assign(ctx.currentInput.size(), false);
+            anyEdits = true;
+          }
+          if(!ctx.editted[pos])
           {
-            currentInput[pos] = currentInput[pos]->copy();
-            editted[pos] = true;
+            // the original may be shared with other branches or rules
+            Chunk* copy = ctx.chunkPool->next();
+            ctx.currentInput[pos]->copyInto(copy);
+            ctx.currentInput[pos] = copy;
+            ctx.editted[pos] = true;
           }
-          currentInput[pos]->setChunkPart(attr_items[part], popString());
-          if(printingSteps) { cerr << " -> " << currentInput[pos]->target << endl; }
+          ctx.currentInput[pos]->setChunkPart(grammar->getAttr(part), ctx.popString());
+          if(printingSteps) { cerr << " -> " << ctx.currentInput[pos]->target << endl; }
         }
         else
         {
-          theStack[stackIdx].c->setChunkPart(attr_items[part], popString());
+          ctx.theStack[ctx.stackIdx].c->setChunkPart(grammar->getAttr(part), ctx.popString());
         }
       }
         break;
       case FETCHVAR:
         if(printingSteps) { cerr << "[" << i << "] fetchvar" << endl; }
         {
-          UString name = popString();
-          UString val = currentBranch->stringVars[name];
-          UString wblank_val = currentBranch->wblankVars[name];
-          pushStack(val, wblank_val);
+          UString name = ctx.popString();
+          UString val = ctx.currentBranch->stringVars[name];
+          UString wblank_val = ctx.currentBranch->wblankVars[name];
+          ctx.pushStack(val, wblank_val);
           if(printingSteps) { cerr << " -> " << name << " = " << val << endl; }
         }
         break;
       case FETCHCHUNK:
         if(printingSteps) { cerr << "[" << i << "] fetchchunk" << endl; }
-        pushStack(currentBranch->chunkVars[popInt()]);
+        ctx.pushStack(ctx.currentBranch->chunkVars[ctx.popInt()]);
         break;
       case SETCHUNK:
         if(printingSteps) { cerr << "[" << i << "] setchunk" << endl; }
         {
-          int pos = popInt();
-          currentBranch->chunkVars[pos] = popChunk();
+          int pos = ctx.popInt();
+          ctx.currentBranch->chunkVars[pos] = ctx.popChunk();
         }
         break;
       case GETCASE:
         if(printingSteps) { cerr << "[" << i << "] getcase" << endl; }
-        pushStack(StringUtils::getcase(popString()));
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx].s << endl; }
+        ctx.pushStack(StringUtils::getcase(ctx.popString()));
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx].s << endl; }
         break;
       case SETCASE:
         if(printingSteps) { cerr << "[" << i << "] setcase" << endl; }
       {
-        UString src = popString();
-        UString dest = popString();
-        pushStack(StringUtils::copycase(src, dest));
+        UString src = ctx.popString();
+        UString dest = ctx.popString();
+        ctx.pushStack(StringUtils::copycase(src, dest));
       }
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx].s << endl; }
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx].s << endl; }
         break;
       case CONCAT:
         if(printingSteps) { cerr << "[" << i << "] concat" << endl; }
       {
-        if(theStack[stackIdx].mode != 2 || theStack[stackIdx-1].mode != 2)
+        if(ctx.theStack[ctx.stackIdx].mode != 2 || ctx.theStack[ctx.stackIdx-1].mode != 2)
         {
-          cerr << "Cannot CONCAT non-strings." << endl;
-          exit(EXIT_FAILURE);
+          throw runtime_error("Cannot CONCAT non-strings.");
         }
-        stackIdx--;
-        theStack[stackIdx].s.append(theStack[stackIdx+1].s);
+        ctx.stackIdx--;
+        ctx.theStack[ctx.stackIdx].s.append(ctx.theStack[ctx.stackIdx+1].s);
       }
         break;
       case CHUNK:
         if(printingSteps) { cerr << "[" << i << "] chunk" << endl; }
       {
-        Chunk* ch = chunkPool.next();
+        Chunk* ch = ctx.chunkPool->next();
         ch->isBlank = false;
-        pushStack(ch);
+        ctx.pushStack(ch);
       }
         break;
       case APPENDCHILD:
         if(printingSteps) { cerr << "[" << i << "] appendchild" << endl; }
       {
-        Chunk* kid = popChunk();
+        Chunk* kid = ctx.popChunk();
         if(isLinear && kid->target[0] == '^')
         {
           unsigned int j = 0;
@@ -784,22 +899,22 @@ RTXProcessor::applyRule(const UString& rule)
           {
             if(kid->target[j] == '$') break;
           }
-          Chunk* ch = chunkPool.next();
+          Chunk* ch = ctx.chunkPool->next();
           ch->isBlank = false;
-          ch->target = kid->target.substr(1, j-1);
-          ch->wblank = out_wblank;
-          out_wblank.clear();
-          theStack[stackIdx].c->contents.push_back(ch);
-          ch = chunkPool.next();
+          ch->target.assign(kid->target, 1, j-1);
+          ch->wblank = ctx.out_wblank;
+          ctx.out_wblank.clear();
+          ctx.theStack[ctx.stackIdx].c->contents.push_back(ch);
+          ch = ctx.chunkPool->next();
           ch->isBlank = true;
-          ch->target = kid->target.substr(j+1);
-          theStack[stackIdx].c->contents.push_back(ch);
+          ch->target.assign(kid->target, j+1);
+          ctx.theStack[ctx.stackIdx].c->contents.push_back(ch);
         }
         else
         {
-          kid->wblank = out_wblank;
-          out_wblank.clear();
-          theStack[stackIdx].c->contents.push_back(kid);
+          if(kid->wblank != ctx.out_wblank) kid = copyWithWblank(ctx, kid);
+          ctx.out_wblank.clear();
+          ctx.theStack[ctx.stackIdx].c->contents.push_back(kid);
         }
         if(printingSteps) { cerr << " -> child with surface '" << kid->target << "' appended" << endl; }
       }
@@ -807,126 +922,120 @@ RTXProcessor::applyRule(const UString& rule)
       case APPENDSURFACE:
         if(printingSteps) { cerr << "[" << i << "] appendsurface" << endl; }
       {
-        if(theStack[stackIdx].mode != 2 && theStack[stackIdx].mode != 3)
+        if(ctx.theStack[ctx.stackIdx].mode != 2 && ctx.theStack[ctx.stackIdx].mode != 3)
         {
-          cerr << "Cannot append non-string to chunk surface." << endl;
-          exit(EXIT_FAILURE);
+          throw runtime_error("Cannot append non-string to chunk surface.");
         }
-        stackIdx--;
-        if(theStack[stackIdx].mode != 3)
+        ctx.stackIdx--;
+        if(ctx.theStack[ctx.stackIdx].mode != 3)
         {
-          cerr << "Cannot APPENDSURFACE to non-chunk." << endl;
-          exit(EXIT_FAILURE);
+          throw runtime_error("Cannot APPENDSURFACE to non-chunk.");
         }
-        if(theStack[stackIdx+1].mode == 2)
+        if(ctx.theStack[ctx.stackIdx+1].mode == 2)
         {
-          theStack[stackIdx].c->target += theStack[stackIdx+1].s;
-          out_wblank = combineWblanks(out_wblank, theWblankStack[stackIdx+1]);
-          theWblankStack[stackIdx+1].clear();
+          ctx.theStack[ctx.stackIdx].c->target += ctx.theStack[ctx.stackIdx+1].s;
+          ctx.out_wblank = combineWblanks(ctx.out_wblank, ctx.theWblankStack[ctx.stackIdx+1]);
+          ctx.theWblankStack[ctx.stackIdx+1].clear();
         }
         else
         {
-          theStack[stackIdx].c->target += theStack[stackIdx+1].c->target;
-          theStack[stackIdx].c->wblank += theStack[stackIdx+1].c->wblank;
+          ctx.theStack[ctx.stackIdx].c->target += ctx.theStack[ctx.stackIdx+1].c->target;
+          ctx.theStack[ctx.stackIdx].c->wblank += ctx.theStack[ctx.stackIdx+1].c->wblank;
         }
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx+1].s << endl; }
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx+1].s << endl; }
       }
         break;
       case APPENDSURFACESL:
         if(printingSteps) { cerr << "[" << i << "] appendsurfacesl" << endl; }
       {
-        if(theStack[stackIdx].mode != 2 && theStack[stackIdx].mode != 3)
+        if(ctx.theStack[ctx.stackIdx].mode != 2 && ctx.theStack[ctx.stackIdx].mode != 3)
         {
-          cerr << "Cannot append non-string to chunk surface." << endl;
-          exit(EXIT_FAILURE);
+          throw runtime_error("Cannot append non-string to chunk surface.");
         }
-        stackIdx--;
-        if(theStack[stackIdx].mode != 3)
+        ctx.stackIdx--;
+        if(ctx.theStack[ctx.stackIdx].mode != 3)
         {
-          cerr << "Cannot APPENDSURFACESL to non-chunk." << endl;
-          exit(EXIT_FAILURE);
+          throw runtime_error("Cannot APPENDSURFACESL to non-chunk.");
         }
-        if(theStack[stackIdx+1].mode == 2)
+        if(ctx.theStack[ctx.stackIdx+1].mode == 2)
         {
-          theStack[stackIdx].c->source += theStack[stackIdx+1].s;
-          out_wblank = combineWblanks(out_wblank, theWblankStack[stackIdx+1]);
-          theWblankStack[stackIdx+1].clear();
+          ctx.theStack[ctx.stackIdx].c->source += ctx.theStack[ctx.stackIdx+1].s;
+          ctx.out_wblank = combineWblanks(ctx.out_wblank, ctx.theWblankStack[ctx.stackIdx+1]);
+          ctx.theWblankStack[ctx.stackIdx+1].clear();
         }
         else
         {
-          theStack[stackIdx].c->source += theStack[stackIdx+1].c->source;
-          theStack[stackIdx].c->wblank += theStack[stackIdx+1].c->wblank;
+          ctx.theStack[ctx.stackIdx].c->source += ctx.theStack[ctx.stackIdx+1].c->source;
+          ctx.theStack[ctx.stackIdx].c->wblank += ctx.theStack[ctx.stackIdx+1].c->wblank;
         }
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx+1].s << endl; }
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx+1].s << endl; }
       }
         break;
       case APPENDSURFACEREF:
         if(printingSteps) { cerr << "[" << i << "] appendsurfaceref" << endl; }
       {
-        if(theStack[stackIdx].mode != 2 && theStack[stackIdx].mode != 3)
+        if(ctx.theStack[ctx.stackIdx].mode != 2 && ctx.theStack[ctx.stackIdx].mode != 3)
         {
-          cerr << "Cannot append non-string to chunk surface." << endl;
-          exit(EXIT_FAILURE);
+          throw runtime_error("Cannot append non-string to chunk surface.");
         }
-        stackIdx--;
-        if(theStack[stackIdx].mode != 3)
+        ctx.stackIdx--;
+        if(ctx.theStack[ctx.stackIdx].mode != 3)
         {
-          cerr << "Cannot APPENDSURFACEREF to non-chunk." << endl;
-          exit(EXIT_FAILURE);
+          throw runtime_error("Cannot APPENDSURFACEREF to non-chunk.");
         }
-        if(theStack[stackIdx+1].mode == 2)
+        if(ctx.theStack[ctx.stackIdx+1].mode == 2)
         {
-          theStack[stackIdx].c->coref += theStack[stackIdx+1].s;
+          ctx.theStack[ctx.stackIdx].c->coref += ctx.theStack[ctx.stackIdx+1].s;
         }
         else
         {
-          theStack[stackIdx].c->coref += theStack[stackIdx+1].c->coref;
+          ctx.theStack[ctx.stackIdx].c->coref += ctx.theStack[ctx.stackIdx+1].c->coref;
         }
-        if(printingSteps) { cerr << " -> " << theStack[stackIdx+1].s << endl; }
+        if(printingSteps) { cerr << " -> " << ctx.theStack[ctx.stackIdx+1].s << endl; }
       }
         break;
       case APPENDALLCHILDREN:
         if(printingSteps) { cerr << "[" << i << "] appendallchildren" << endl; }
       {
-        Chunk* ch = popChunk();
+        Chunk* ch = ctx.popChunk();
         for(unsigned int k = 0; k < ch->contents.size(); k++)
         {
-          theStack[stackIdx].c->contents.push_back(ch->contents[k]);
+          ctx.theStack[ctx.stackIdx].c->contents.push_back(ch->contents[k]);
         }
       }
         break;
       case APPENDALLINPUT:
         if(printingSteps) { cerr << "[" << i << "] appendallinput" << endl; }
       {
-        vector<Chunk*>& vec = theStack[stackIdx].c->contents;
-        vec.insert(vec.end(), currentInput.begin(), currentInput.end());
+        vector<Chunk*>& vec = ctx.theStack[ctx.stackIdx].c->contents;
+        vec.insert(vec.end(), ctx.currentInput.begin(), ctx.currentInput.end());
       }
         break;
       case BLANK:
         if(printingSteps) { cerr << "[" << i << "] blank" << endl; }
       {
-        int loc = 2*(popInt()-1) + 1;
+        int loc = 2*(ctx.popInt()-1) + 1;
         if(loc == -1)
         {
-          Chunk* ch = chunkPool.next();
+          Chunk* ch = ctx.chunkPool->next();
           ch->target = " "_u;
           ch->isBlank = true;
-          pushStack(ch);
+          ctx.pushStack(ch);
         }
         else
         {
-          pushStack(currentInput[loc]);
+          ctx.pushStack(ctx.currentInput[loc]);
         }
       }
         break;
       case CONJOIN:
         if(printingSteps) { cerr << "[" << i << "] conjoin" << endl; }
       {
-        Chunk* join = chunkPool.next();
+        Chunk* join = ctx.chunkPool->next();
         join->isBlank = true;
         join->isJoiner = true;
         join->target = "+"_u;
-        pushStack(join);
+        ctx.pushStack(join);
       }
         break;
       case REJECTRULE:
@@ -936,12 +1045,11 @@ RTXProcessor::applyRule(const UString& rule)
       case DISTAG:
         if(printingSteps) { cerr << "[" << i << "] distag" << endl; }
       {
-        if(theStack[stackIdx].mode != 2)
+        if(ctx.theStack[ctx.stackIdx].mode != 2)
         {
-          cerr << "Cannot DISTAG non-string." << endl;
-          exit(EXIT_FAILURE);
+          throw runtime_error("Cannot DISTAG non-string.");
         }
-        UString& s = theStack[stackIdx].s;
+        UString& s = ctx.theStack[ctx.stackIdx].s;
         if(s.size() > 0 && s[0] == '<' && s[s.size()-1] == '>')
         {
           s = StringUtils::substitute(s.substr(1, s.size()-2), "><"_u, "."_u);
@@ -951,39 +1059,39 @@ RTXProcessor::applyRule(const UString& rule)
       case GETRULE:
         if(printingSteps) { cerr << "[" << i << "] getrule" << endl; }
       {
-        int pos = 2*(popInt()-1);
-        pushStack(currentInput[pos]->rule);
+        int pos = 2*(ctx.popInt()-1);
+        ctx.pushStack(ctx.currentInput[pos]->rule);
       }
         break;
       case SETRULE:
         if(printingSteps) { cerr << "[" << i << "] setrule" << endl; }
       {
-        int pos = 2*(popInt()-1);
-        int rl = popInt();
+        int pos = 2*(ctx.popInt()-1);
+        int rl = ctx.popInt();
         if(pos == -2)
         {
-          if(stackIdx == 0 || theStack[stackIdx].mode != 3)
+          if(ctx.stackIdx == 0 || ctx.theStack[ctx.stackIdx].mode != 3)
           {
-            cerr << "Empty stack or top item is not chunk." << endl;
-            cerr << "Check for conditionals that might not generate output" << endl;
-            cerr << "and ensure that lists of attributes are complete." << endl;
-            exit(1);
+            throw runtime_error("Empty stack or top item is not chunk.\n"
+                                "Check for conditionals that might not generate output\n"
+                                "and ensure that lists of attributes are complete.");
           }
-          theStack[stackIdx].c->rule = rl;
+          ctx.theStack[ctx.stackIdx].c->rule = rl;
         }
         else
         {
-          currentInput[pos]->rule = rl;
+          ctx.currentInput[pos]->rule = rl;
         }
       }
         break;
       case LUCOUNT:
         if(printingSteps) { cerr << "[" << i << "] lucount" << endl; }
-        pushStack(StringUtils::itoa((currentInput.size() + 1) / 2));
+        ctx.pushStack(StringUtils::itoa((ctx.currentInput.size() + 1) / 2));
         break;
       default:
-        cerr << "unknown instruction: [" << i << "] " << (int)rule[i] << endl;
-        exit(1);
+        ostringstream msg;
+        msg << "unknown instruction: [" << i << "] " << (int)rule[i];
+        throw runtime_error(msg.str());
     }
   }
   return true;
@@ -992,144 +1100,38 @@ RTXProcessor::applyRule(const UString& rule)
 Chunk *
 RTXProcessor::readToken()
 {
-  int pos = 0;
-  UString cur;
-  UString wbl;
-  UString src;
-  UString dest;
-  UString coref;
-  cur.reserve(256);
-  while(true)
+  TokenKind kind = nextToken();
+  Chunk* ret = tokenPool[tokenGen].next();
+  if(kind != TokenWord)
   {
-    UChar32 val = infile.get();
-    if (infile.eof() || (null_flush && val == '\0')) {
-      furtherInput = false;
-      Chunk* ret = chunkPool.next();
-      ret->target = cur;
-      ret->isBlank = true;
-      return ret;
-    }
-    else if(val == '\\')
-    {
-      cur += '\\';
-      cur += infile.get();
-    }
-    else if(val == '[' && !inword)
-    {
-      val = infile.get();
-      
-      if(val == '[')
-      {
-        inwblank = true;
-        Chunk* ret = chunkPool.next();
-        ret->target = cur;
-        ret->isBlank = true;
-        return ret;
-      }
-      else
-      {
-        infile.unget(val);
-        cur += infile.readBlock('[', ']');
-      }
-    }
-    else if(inwblank)
-    {
-      if(val == ']')
-      {
-        cur += val;
-        val = infile.get();
-        
-        if(val == '\\')
-        {
-          cur += '\\';
-          cur += infile.get();
-        }
-        else if(val == ']')
-        {
-          cur += val;
-          val = infile.get();
-          
-          if(val == '\\')
-          {
-            cur += '\\';
-            cur += infile.get();
-          }
-          else if(val == '^')
-          {
-            inwblank = false;
-            cur = "[["_u + cur;
-            wbl.swap(cur);
-            inword = true;
-          }
-          else
-          {
-            cerr << "Parse Error: Wordbound blank should be immediately followed by a Lexical Unit -> [[..]]^..$" << endl;
-            exit(EXIT_FAILURE);
-          }
-        }
-        else
-        {
-          cur += val;
-        }
-      }
-      else
-      {
-        cur += val;
-      }
-    }
-    else if(inword && (val == '$' || val == '/'))
-    {
-      if(pos == 0)
-      {
-        src.swap(cur);
-      }
-      else if(pos == 1)
-      {
-        dest.swap(cur);
-      }
-      else if(pos >= 2 && !noCoref && val == '$')
-      {
-        coref.swap(cur);
-      }
-      else
-      {
-        cur.clear();
-      }
-      pos++;
-      if(val == '$')
-      {
-        inword = false;
-        Chunk* ret = chunkPool.next();
-        ret->wblank = wbl;
-        ret->source = src;
-        ret->target = dest;
-        ret->coref = coref;
-        ret->isBlank = false;
-        if(src.size() > 0 && src[0] == '*' && dest.size() > 0 && dest[0] == '*')
-        {
-          Chunk* ret2 = chunkPool.next();
-          ret2->target = ret->target.substr(1) + "<UNKNOWN:INTERNAL>"_u;
-          ret2->contents.push_back(ret);
-          ret2->rule = -1;
-          ret2->isBlank = false;
-          return ret2;
-        }
-        return ret;
-      }
-    }
-    else if(!inword && val == '^')
-    {
-      inword = true;
-      Chunk* ret = chunkPool.next();
-      ret->target = cur;
-      ret->isBlank = true;
-      return ret;
-    }
-    else
+    if(kind == TokenEnd)
     {
-      cur += val;
+      furtherInput = false;
     }
+    ret->target = token.blank;
+    ret->isBlank = true;
+    return ret;
+  }
+  ret->wblank = token.wblank;
+  ret->source = token.source;
+  ret->target = token.target;
+  if(!noCoref)
+  {
+    ret->coref = token.coref;
+  }
+  ret->isBlank = false;
+  if(ret->source.size() > 0 && ret->source[0] == '*' &&
+     ret->target.size() > 0 && ret->target[0] == '*')
+  {
+    Chunk* ret2 = tokenPool[tokenGen].next();
+    ret2->target.assign(ret->target, 1);
+    ret2->target.append("<UNKNOWN:INTERNAL>"_u);
+    ret2->contents.push_back(ret);
+    ret2->rule = -1;
+    ret2->isBlank = false;
+    return ret2;
   }
+  return ret;
 }
 
 bool
@@ -1142,6 +1144,7 @@ void
 RTXProcessor::setNullFlush(bool null_flush)
 {
   this->null_flush = null_flush;
+  infile.setNullFlush(null_flush);
 }
 
 bool
@@ -1179,303 +1182,578 @@ RTXProcessor::setOutputMode(string mode)
 }
 
 bool
-RTXProcessor::lookahead(ParseNode* node)
+RTXProcessor::lookahead(ParseContext& ctx, ParseNode* node, int cont, int pos)
 {
   Chunk* next = NULL;
-  for(vector<vector<Chunk*>*>::reverse_iterator it = currentContinuation.rbegin(),
-        limit = currentContinuation.rend(); it != limit; it++)
+  while(next == NULL && cont != -1)
   {
-    for(vector<Chunk*>::reverse_iterator it2 = (*it)->rbegin(), limit2 = (*it)->rend();
-        it2 != limit2; it++)
+    for(int limit = ctx.currentContinuations[cont].end; pos < limit; pos++)
     {
-      if(!(*it2)->isBlank)
+      if(!ctx.continuationChunks[pos]->isBlank)
       {
-        next = *it2;
+        next = ctx.continuationChunks[pos];
         break;
       }
     }
-    if(next != NULL) break;
+    pos = ctx.currentContinuations[cont].parentPos;
+    cont = ctx.currentContinuations[cont].parent;
   }
   if(next == NULL)
   {
-    for(list<Chunk*>::iterator it = inputBuffer.begin(), limit = inputBuffer.end();
-        it != limit; it++)
+    for(unsigned int i = 0, limit = inputBuffer.size(); i < limit; i++)
     {
-      if(!(*it)->isBlank)
+      if(!inputBuffer[i]->isBlank)
       {
-        next = *it;
+        next = inputBuffer[i];
         break;
       }
     }
   }
-  return (next != NULL && node->shouldShift(next));
+  if(next == NULL) return false;
+  if(next == lookaheadToken) return node->shouldShift(lookaheadSymbols);
+  return node->shouldShift(next);
 }
 
 void
-RTXProcessor::checkForReduce(vector<ParseNode*>& result, ParseNode* node)
-{
-  if(printingAll) cerr << "Checking for reductions for branch " << node->id << endl;
-  mx->resetRejected();
-  pair<int, double> rule_and_weight = node->getRule();
-  int rule = rule_and_weight.first;
-  double weight = node->weight + rule_and_weight.second;
-  currentBranch = node;
-  while(rule != -1)
-  {
-    int len = pat_size[rule-1];
-    int first;
-    int last = node->lastWord;
-    currentInput.resize(len);
-    node->getChunks(currentInput, len-1);
-    currentOutput.clear();
-    if(printingRules || printingAll) {
-      if(printingAll && treePrintMode == TreeModeLatex) cerr << "\\subsection{";
-      else cerr << endl;
-      cerr << "Applying rule " << rule;
-      if(rule <= (int)inRuleNames.size())
-      {
-        cerr << " (" << inRuleNames[rule-1] << ")";
-      }
-      if(printingAll) cerr << " to branch " << node->id << " with weight " << rule_and_weight.second;
-      if(printingAll && treePrintMode == TreeModeLatex) cerr << "}" << endl << endl;
-      else cerr << ": ";
-      for(unsigned int i = 0; i < currentInput.size(); i++)
-      {
-        currentInput[i]->writeTree((printingAll ? treePrintMode : TreeModeFlat), NULL);
-      }
-      cerr << endl;
-    }
-    if(applyRule(rule_map[rule-1]))
+RTXProcessor::prepareLookahead()
+{
+  for(unsigned int i = 0, limit = inputBuffer.size(); i < limit; i++)
+  {
+    if(!inputBuffer[i]->isBlank)
     {
-      if(printingAll)
-      {
-        for(auto c : currentOutput) c->writeTree(treePrintMode, NULL);
-        cerr << endl;
-      }
-      vector<Chunk*> temp;
-      temp.reserve(currentOutput.size());
-      while(currentOutput.size() > 1)
-      {
-        temp.push_back(currentOutput.back());
-        currentOutput.pop_back();
-      }
-      ParseNode* back = node->popNodes(len);
-      ParseNode* cur = parsePool.next();
-      if(back == NULL)
-      {
-        first = 0;
-        cur->init(mx, currentOutput[0], weight);
-      }
-      else
-      {
-        first = back->lastWord+1;
-        cur->init(back, currentOutput[0], weight);
-      }
-      cur->stringVars = node->stringVars;
-      cur->wblankVars = node->wblankVars;
-      cur->chunkVars = node->chunkVars;
-      cur->id = node->id;
-      if(temp.size() == 0)
-      {
-        checkForReduce(result, cur);
-        break;
-      }
-      currentContinuation.push_back(&temp);
-      vector<ParseNode*> res;
-      vector<ParseNode*> res2;
-      checkForReduce(res, cur);
-      while(temp.size() > 0)
-      {
-        for(vector<ParseNode*>::iterator it = res.begin(), limit = res.end();
-              it != limit; it++)
-        {
-          cur = parsePool.next();
-          cur->init(*it, temp.back());
-          cur->stringVars = (*it)->stringVars;
-          cur->wblankVars = (*it)->wblankVars;
-          cur->chunkVars = (*it)->chunkVars;
-          cur->firstWord = first;
-          cur->lastWord = last;
-          checkForReduce(res2, cur);
-        }
-        temp.pop_back();
-        res.clear();
-        res.swap(res2);
-      }
-      result.reserve(result.size() + res.size());
-      for(vector<ParseNode*>::iterator it = res.begin(), limit = res.end();
-            it != limit; it++)
+      if(inputBuffer[i] != lookaheadToken)
       {
-        result.push_back(*it);
+        lookaheadToken = inputBuffer[i];
+        mx->prepareSymbols(lookaheadToken->matchSurface(), lookaheadSymbols);
       }
-      currentContinuation.pop_back();
-      break;
-    }
-    else
-    {
-      if(printingRules) { cerr << " -> rule was rejected" << endl; }
-      if(printingAll) cerr << "This rule was rejeced." << endl << endl;
-      mx->rejectRule(rule);
-      rule_and_weight = node->getRule();
-      rule = rule_and_weight.first;
-      weight = node->weight + rule_and_weight.second;
+      return;
     }
   }
-  if(rule == -1)
+}
+
+void
+RTXProcessor::continueReduce(ParseContext& ctx, vector<ParseNode*>& result, ParseNode* node, int cont, int pos)
+{
+  while(cont != -1 && pos == ctx.currentContinuations[cont].end)
   {
-    if(printingAll) cerr << "No further reductions possible for branch " << node->id << "." << endl;
-    result.push_back(node);
+    pos = ctx.currentContinuations[cont].parentPos;
+    cont = ctx.currentContinuations[cont].parent;
   }
-  else if(lookahead(node))
+  if(cont == -1)
   {
-    node->id = ++newBranchId;
-    if(printingAll) cerr << endl << "Splitting stack and creating branch " << node->id << endl;
     result.push_back(node);
+    return;
   }
+  ParseNode* cur = ctx.parsePool->next();
+  cur->init(node, ctx.continuationChunks[pos], 0.0, false);
+  cur->takeVars(node);
+  cur->id = node->id;
+  cur->firstWord = ctx.currentContinuations[cont].firstWord;
+  cur->lastWord = ctx.currentContinuations[cont].lastWord;
+  ctx.reduceQueue.push_back(ReduceItem{cur, cont, pos+1, false});
 }
 
 void
-RTXProcessor::outputAll(UFILE* out)
+RTXProcessor::advanceBranch(ParseContext& ctx, ParseNode* branch, Chunk* next, vector<ParseNode*>& result)
 {
-  unsigned int queueSize = outputQueue.size() - 1;
-  bool conjoining = false;
-  Chunk* tojoin = NULL;
-  while(outputQueue.size() > 0)
+  ParseNode* node = ctx.parsePool->next();
+  node->init(branch, next, nextSymbols, false);
+  // branch has no other successors, so its variables can be moved
+  node->takeVars(branch);
+  node->id = branch->id;
+  checkForReduce(ctx, result, node);
+}
+
+void
+RTXProcessor::checkForReduce(ParseContext& ctx, vector<ParseNode*>& result, ParseNode* node)
+{
+  ctx.reduceQueue.clear();
+  ctx.currentContinuations.clear();
+  ctx.continuationChunks.clear();
+  ctx.reduceQueue.push_back(ReduceItem{node, -1, 0, false});
+  while(!ctx.reduceQueue.empty())
   {
-    Chunk* ch = outputQueue.front();
-    outputQueue.pop_front();
-    if(printingTrees && outputQueue.size() == queueSize)
+    ReduceItem item = ctx.reduceQueue.back();
+    ctx.reduceQueue.pop_back();
+    node = item.node;
+    if(item.fork)
     {
-      if(printingText) u_fputc('\n', out);
-      queueSize--;
-      ch->writeTree(treePrintMode, out);
-      u_fflush(out);
-      if(!printingText) continue;
+      // a reduction was possible, but so is a shift
+      node->id = ++newBranchId;
+      if(printingAll) cerr << endl << "Splitting stack and creating branch " << node->id << endl;
+      continueReduce(ctx, result, node, item.cont, item.pos);
+      continue;
     }
-    if(ch->rule == -1)
+    if(printingAll) cerr << "Checking for reductions for branch " << node->id << endl;
+    ctx.rejected.clear();
+    pair<int, double> rule_and_weight = node->getRule(ctx.rejected);
+    int rule = rule_and_weight.first;
+    double weight = node->weight + rule_and_weight.second;
+    ctx.currentBranch = node;
+    while(rule != -1)
     {
-      if(printingRules && !ch->isBlank)
-      {
-        u_fflush(out);
-        cerr << endl << "No rule specified: ";
-        ch->writeTree(TreeModeFlat, NULL);
-        cerr << endl;
-      }
-      if(printingAll && !ch->isBlank)
-      {
-        if(treePrintMode == TreeModeLatex) cerr << "\\subsubsection{Output Node}" << endl;
-        else cerr << "Output Node:" << endl;
-        ch->writeTree(treePrintMode, NULL);
+      int len = grammar->patternSize(rule);
+      int first;
+      int last = node->lastWord;
+      ctx.currentInput.resize(len);
+      node->getChunks(ctx.currentInput, len-1);
+      ctx.currentOutput.clear();
+      if(printingRules || printingAll) {
+        if(printingAll && treePrintMode == TreeModeLatex) cerr << "\\subsection{";
+        else cerr << endl;
+        cerr << "Applying rule " << rule;
+        if(rule <= (int)grammar->inputRuleNames().size())
+        {
+          cerr << " (" << grammar->inputRuleNames()[rule-1] << ")";
+        }
+        if(printingAll) cerr << " to branch " << node->id << " with weight " << rule_and_weight.second;
+        if(printingAll && treePrintMode == TreeModeLatex) cerr << "}" << endl << endl;
+        else cerr << ": ";
+        for(unsigned int i = 0; i < ctx.currentInput.size(); i++)
+        {
+          ctx.currentInput[i]->writeTree((printingAll ? treePrintMode : TreeModeFlat), NULL);
+        }
         cerr << endl;
       }
-      if(ch->contents.size() > 0)
+      if(applyInputRule(ctx, rule))
       {
-        vector<UString> tags = ch->getTags(vector<UString>());
-        for(auto it = ch->contents.rbegin(); it != ch->contents.rend(); it++)
+        if(printingAll)
         {
-          (*it)->updateTags(tags);
-          outputQueue.push_front(*it);
+          for(auto c : ctx.currentOutput) c->writeTree(treePrintMode, NULL);
+          cerr << endl;
         }
-      }
-      else if(conjoining && !ch->isBlank)
-      {
-        tojoin->conjoin(ch);
-      }
-      else if(ch->isJoiner)
-      {
-        if(tojoin != NULL) conjoining = true;
-      }
-      else
-      {
-        conjoining = false;
-        if(tojoin != NULL)
+        ParseNode* back = node->popNodes(len);
+        ParseNode* cur = ctx.parsePool->next();
+        if(back == NULL)
         {
-          tojoin->output(out);
-          tojoin = NULL;
+          first = 0;
+          cur->init(mx, ctx.currentOutput[0], weight);
         }
-        if(ch->isBlank)
+        else
         {
-          writeBlank(out);
+          first = back->lastWord+1;
+          cur->init(back, ctx.currentOutput[0], weight, false);
         }
-        else tojoin = ch;
-      }
-    }
-    else
-    {
-      parentChunk = ch;
-      vector<UString> tags = ch->getTags(vector<UString>());
-      currentInput = ch->contents;
-      for(unsigned int i = 0; i < currentInput.size(); i++)
-      {
-        currentInput[i]->updateTags(tags);
-      }
-      currentOutput.clear();
-      if(printingRules) {
-        u_fflush(out);
-        cerr << endl << "Applying output rule " << ch->rule;
-        if(ch->rule < (int)outRuleNames.size())
+        cur->id = node->id;
+        if(lookahead(ctx, node, item.cont, item.pos))
         {
-          cerr << " (" << outRuleNames[ch->rule] << ")";
+          cur->stringVars = node->stringVars;
+          cur->wblankVars = node->wblankVars;
+          cur->chunkVars = node->chunkVars;
+          // pushed first so that it is examined after every branch
+          // that results from reducing this one
+          ctx.reduceQueue.push_back(ReduceItem{node, item.cont, item.pos, true});
         }
-        cerr << ": " << parentChunk->target << " -> ";
-        for(unsigned int i = 0; i < currentInput.size(); i++)
+        else
         {
-          currentInput[i]->writeTree(TreeModeFlat, NULL);
+          // no conflict, so node is finished with
+          cur->takeVars(node);
         }
-        cerr << endl;
-      }
-      if(printingAll)
-      {
-        if(treePrintMode == TreeModeLatex)
+        if(ctx.currentOutput.size() == 1)
         {
-          cerr << "\\subsubsection{Applying Output Rule " << ch->rule;
-          if(ch->rule < (int)outRuleNames.size())
-          {
-            cerr << ": " << outRuleNames[ch->rule] << "}" << endl << endl;
-          }
+          ctx.reduceQueue.push_back(ReduceItem{cur, item.cont, item.pos, false});
         }
         else
         {
-          cerr << "Applying Output Rule " << ch->rule;
-          if(ch->rule < (int)outRuleNames.size())
-          {
-            cerr << ": " << outRuleNames[ch->rule] << endl << endl;
-          }
+          ReduceContinuation cont;
+          cont.parent = item.cont;
+          cont.parentPos = item.pos;
+          cont.begin = ctx.continuationChunks.size();
+          ctx.continuationChunks.insert(ctx.continuationChunks.end(),
+                                    ctx.currentOutput.begin()+1, ctx.currentOutput.end());
+          cont.end = ctx.continuationChunks.size();
+          cont.firstWord = first;
+          cont.lastWord = last;
+          ctx.currentContinuations.push_back(cont);
+          ctx.reduceQueue.push_back(ReduceItem{cur, (int)ctx.currentContinuations.size()-1, cont.begin, false});
         }
-        ch->writeTree(treePrintMode, NULL);
+        break;
       }
-      u_fflush(out);
-      applyRule(output_rules[ch->rule]);
-      for(vector<Chunk*>::reverse_iterator it = currentOutput.rbegin(),
-              limit = currentOutput.rend(); it != limit; it++)
+      else
       {
-        outputQueue.push_front(*it);
+        if(printingRules) { cerr << " -> rule was rejected" << endl; }
+        if(printingAll) cerr << "This rule was rejeced." << endl << endl;
+        ctx.rejected.push_back(rule);
+        rule_and_weight = node->getRule(ctx.rejected);
+        rule = rule_and_weight.first;
+        weight = node->weight + rule_and_weight.second;
       }
     }
-  }
-  if(tojoin != NULL) tojoin->output(out);
-  while(!blankQueue.empty())
-  {
-    if(blankQueue.front() == " "_u)
-    {
-      blankQueue.pop_front();
-    }
-    else
+    if(rule == -1)
     {
-      writeBlank(out);
+      if(printingAll) cerr << "No further reductions possible for branch " << node->id << "." << endl;
+      continueReduce(ctx, result, node, item.cont, item.pos);
     }
   }
 }
 
 void
-RTXProcessor::writeBlank(UFILE* out)
+RTXProcessor::reparseChunk(Chunk* ch, list<Chunk*>& dest)
 {
-  if(blankQueue.empty())
+  if(printingAll) cerr << "Reparsing chunk ^" << ch->source << "/" << ch->target << "$" << endl;
+  // traces should show the rules being applied, so skip the cache
+  bool useCache = (reparseCacheSize > 0 && !printingAll && !printingRules && !printingSteps);
+  UString key;
+  if(useCache)
   {
-    blankQueue.push_back(" "_u);
-  }
-  Chunk* blank = chunkPool.next();
-  blank->target = blankQueue.front();
+    reparseKey(ch, key);
+    auto entry = reparseCacheIndex.find(key);
+    if(entry != reparseCacheIndex.end())
+    {
+      reparseCacheHits++;
+      reparseCache.splice(reparseCache.begin(), reparseCache, entry->second);
+      for(auto node : entry->second->second)
+      {
+        dest.push_back(copyTree(node, true));
+      }
+      return;
+    }
+    reparseCacheMisses++;
+  }
+  ParseNode* temp = parsePool.next();
+  temp->init(mx, ch);
+  temp->id = ++newBranchId;
+  temp->stringVars = variables;
+  temp->wblankVars = wblank_variables;
+  temp->chunkVars = vector<Chunk*>(grammar->getVarCount(), NULL);
+  checkForReduce(mainContext, parseGraph, temp);
+  parseGraph[0]->getChunks(dest, parseGraph[0]->length-1);
+  parseGraph.clear();
+  if(useCache)
+  {
+    vector<Chunk*> nodes;
+    nodes.reserve(dest.size());
+    for(auto node : dest)
+    {
+      nodes.push_back(copyTree(node, false));
+    }
+    reparseCache.push_front(make_pair(key, nodes));
+    reparseCacheIndex[key] = reparseCache.begin();
+    if(reparseCache.size() > reparseCacheSize)
+    {
+      for(auto node : reparseCache.back().second)
+      {
+        deleteTree(node);
+      }
+      reparseCacheIndex.erase(reparseCache.back().first);
+      reparseCache.pop_back();
+    }
+  }
+}
+
+void
+RTXProcessor::reparseKey(Chunk* ch, UString& key)
+{
+  key += ch->wblank;
+  key += '\0';
+  key += ch->source;
+  key += '\0';
+  key += ch->target;
+  key += '\0';
+  key += ch->coref;
+  key += '\0';
+  key += (ch->isBlank ? '1' : '0');
+  key += (UChar)ch->contents.size();
+  for(auto kid : ch->contents)
+  {
+    reparseKey(kid, key);
+  }
+}
+
+Chunk*
+RTXProcessor::copyTree(Chunk* ch, bool pooled)
+{
+  Chunk* ret = (pooled ? chunkPool.next() : new Chunk());
+  ret->source = ch->source;
+  ret->target = ch->target;
+  ret->coref = ch->coref;
+  ret->wblank = ch->wblank;
+  ret->isBlank = ch->isBlank;
+  ret->isJoiner = ch->isJoiner;
+  ret->rule = ch->rule;
+  ret->contents.reserve(ch->contents.size());
+  for(auto kid : ch->contents)
+  {
+    ret->contents.push_back(copyTree(kid, pooled));
+  }
+  return ret;
+}
+
+Chunk*
+RTXProcessor::relocateTree(Chunk* ch, ChunkPool& dest, unordered_map<Chunk*, Chunk*>& moved)
+{
+  auto it = moved.find(ch);
+  if(it != moved.end())
+  {
+    return it->second;
+  }
+  Chunk* ret = dest.next();
+  moved[ch] = ret;
+  ret->source.swap(ch->source);
+  ret->target.swap(ch->target);
+  ret->coref.swap(ch->coref);
+  ret->wblank.swap(ch->wblank);
+  ret->isBlank = ch->isBlank;
+  ret->isJoiner = ch->isJoiner;
+  ret->rule = ch->rule;
+  ret->contents.swap(ch->contents);
+  for(auto& kid : ret->contents)
+  {
+    kid = relocateTree(kid, dest, moved);
+  }
+  return ret;
+}
+
+void
+RTXProcessor::compactTRX(const vector<list<Chunk*>*>& queues)
+{
+  ChunkPool& dest = tokenPool[1-tokenGen];
+  unordered_map<Chunk*, Chunk*> moved;
+  for(auto queue : queues)
+  {
+    for(auto& ch : *queue)
+    {
+      ch = relocateTree(ch, dest, moved);
+    }
+  }
+  chunkPool.reset();
+  trxLayers[0].chunkPool.reset();
+  trxLayers[1].chunkPool.reset();
+  tokenPool[tokenGen].reset();
+  tokenGen = 1 - tokenGen;
+  compactionCount++;
+}
+
+void
+RTXProcessor::deleteTree(Chunk* ch)
+{
+  for(auto kid : ch->contents)
+  {
+    deleteTree(kid);
+  }
+  delete ch;
+}
+
+void
+RTXProcessor::clearReparseCache()
+{
+  for(auto& entry : reparseCache)
+  {
+    for(auto node : entry.second)
+    {
+      deleteTree(node);
+    }
+  }
+  reparseCache.clear();
+  reparseCacheIndex.clear();
+}
+
+void
+RTXProcessor::printStatistics()
+{
+  unsigned long reparses = reparseCacheHits + reparseCacheMisses;
+  cerr << "Reparse cache: " << reparseCacheHits << " hits, ";
+  cerr << reparseCacheMisses << " misses";
+  if(reparses > 0)
+  {
+    cerr << " (" << (100.0 * reparseCacheHits / reparses) << "% hit rate)";
+  }
+  cerr << ", " << reparseCache.size() << " entries" << endl;
+  if(segmentCacheSize > 0)
+  {
+    unsigned long segments = segmentCacheHits + segmentCacheMisses;
+    cerr << "Segment cache: " << segmentCacheHits << " hits, ";
+    cerr << segmentCacheMisses << " misses";
+    if(segments > 0)
+    {
+      cerr << " (" << (100.0 * segmentCacheHits / segments) << "% hit rate)";
+    }
+    cerr << ", " << segmentCache.size() << " entries" << endl;
+  }
+  cerr << "Rule applications shared between branches: " << sharedRuleCount << endl;
+  cerr << "Chunks allocated: " << chunkPool.allocationCount()
+       << " (peak " << chunkPool.peakSize() << ", "
+       << chunkPool.bucketAllocationCount() << " buckets allocated)" << endl;
+  cerr << "Parse nodes allocated: " << parsePool.allocationCount()
+       << " (peak " << parsePool.peakSize() << ", "
+       << parsePool.bucketAllocationCount() << " buckets allocated)" << endl;
+  cerr << "Steps with a single branch: " << singleBranchStepCount << " of " << stepCount << endl;
+  if(branchThreads != NULL)
+  {
+    cerr << "Parallel branch steps: " << parallelStepCount << " (" << branchThreads->size() << " threads)" << endl;
+  }
+  cerr << "Flushes: " << flushCount << " (" << forcedFlushCount << " forced, "
+       << budgetFlushCount << " by the memory budget)" << endl;
+  if(compactionCount > 0)
+  {
+    cerr << "Pool compactions: " << compactionCount << endl;
+  }
+  if(pipelined)
+  {
+    cerr << "Token queue: parser waited " << tokenQueueEmptyWaits << " times, tokenizer waited "
+         << tokenQueueFullWaits << " times" << endl;
+  }
+  if(layerThreads && isLinear)
+  {
+    cerr << "Layer queues: layers waited " << layerQueueEmptyWaits << " times for input, "
+         << layerQueueFullWaits << " times for space" << endl;
+  }
+  cerr << "Peak memory: " << (peakPendingMemory >> 10) << "KB for a pending sentence";
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) == 0)
+  {
+    // ru_maxrss is in kilobytes on Linux
+    cerr << ", " << usage.ru_maxrss << "KB resident";
+  }
+  cerr << endl;
+}
+
+void
+RTXProcessor::outputAll(OutputWriter* out)
+{
+  unsigned int queueSize = outputQueue.size() - 1;
+  bool conjoining = false;
+  Chunk* tojoin = NULL;
+  while(outputQueue.size() > 0)
+  {
+    Chunk* ch = outputQueue.front();
+    outputQueue.pop_front();
+    if(printingTrees && outputQueue.size() == queueSize)
+    {
+      if(printingText) out->put('\n');
+      queueSize--;
+      ch->writeTree(treePrintMode, out);
+      out->flush();
+      if(!printingText) continue;
+    }
+    if(ch->rule == -1)
+    {
+      if(printingRules && !ch->isBlank)
+      {
+        out->flush();
+        cerr << endl << "No rule specified: ";
+        ch->writeTree(TreeModeFlat, NULL);
+        cerr << endl;
+      }
+      if(printingAll && !ch->isBlank)
+      {
+        if(treePrintMode == TreeModeLatex) cerr << "\\subsubsection{Output Node}" << endl;
+        else cerr << "Output Node:" << endl;
+        ch->writeTree(treePrintMode, NULL);
+        cerr << endl;
+      }
+      if(ch->contents.size() > 0)
+      {
+        vector<UString> tags = ch->getTags(vector<UString>());
+        for(auto it = ch->contents.rbegin(); it != ch->contents.rend(); it++)
+        {
+          (*it)->updateTags(tags);
+          outputQueue.push_front(*it);
+        }
+      }
+      else if(conjoining && !ch->isBlank)
+      {
+        tojoin->conjoin(ch);
+      }
+      else if(ch->isJoiner)
+      {
+        if(tojoin != NULL) conjoining = true;
+      }
+      else
+      {
+        conjoining = false;
+        if(tojoin != NULL)
+        {
+          tojoin->output(out);
+          tojoin = NULL;
+        }
+        if(ch->isBlank)
+        {
+          writeBlank(out);
+        }
+        else tojoin = ch;
+      }
+    }
+    else
+    {
+      mainContext.parentChunk = ch;
+      vector<UString> tags = ch->getTags(vector<UString>());
+      mainContext.currentInput = ch->contents;
+      for(unsigned int i = 0; i < mainContext.currentInput.size(); i++)
+      {
+        mainContext.currentInput[i]->updateTags(tags);
+      }
+      mainContext.currentOutput.clear();
+      if(printingRules) {
+        out->flush();
+        cerr << endl << "Applying output rule " << ch->rule;
+        if(ch->rule < (int)grammar->outputRuleNames().size())
+        {
+          cerr << " (" << grammar->outputRuleNames()[ch->rule] << ")";
+        }
+        cerr << ": " << mainContext.parentChunk->target << " -> ";
+        for(unsigned int i = 0; i < mainContext.currentInput.size(); i++)
+        {
+          mainContext.currentInput[i]->writeTree(TreeModeFlat, NULL);
+        }
+        cerr << endl;
+      }
+      if(printingAll)
+      {
+        if(treePrintMode == TreeModeLatex)
+        {
+          cerr << "\\subsubsection{Applying Output Rule " << ch->rule;
+          if(ch->rule < (int)grammar->outputRuleNames().size())
+          {
+            cerr << ": " << grammar->outputRuleNames()[ch->rule] << "}" << endl << endl;
+          }
+        }
+        else
+        {
+          cerr << "Applying Output Rule " << ch->rule;
+          if(ch->rule < (int)grammar->outputRuleNames().size())
+          {
+            cerr << ": " << grammar->outputRuleNames()[ch->rule] << endl << endl;
+          }
+        }
+        ch->writeTree(treePrintMode, NULL);
+      }
+      if(printingSteps || printingAll)
+      {
+        // keep the output so far ahead of the trace on stderr
+        out->flush();
+      }
+      applyRule(mainContext, grammar->outputRule(ch->rule));
+      for(vector<Chunk*>::reverse_iterator it = mainContext.currentOutput.rbegin(),
+              limit = mainContext.currentOutput.rend(); it != limit; it++)
+      {
+        outputQueue.push_front(*it);
+      }
+    }
+  }
+  if(tojoin != NULL) tojoin->output(out);
+  while(!blankQueue.empty())
+  {
+    if(blankQueue.front() == " "_u)
+    {
+      blankQueue.pop_front();
+    }
+    else
+    {
+      writeBlank(out);
+    }
+  }
+}
+
+void
+RTXProcessor::writeBlank(OutputWriter* out)
+{
+  if(blankQueue.empty())
+  {
+    blankQueue.push_back(" "_u);
+  }
+  Chunk* blank = chunkPool.next();
+  blank->target = blankQueue.front();
   blankQueue.pop_front();
   blank->isBlank = true;
   if (printingText) {
@@ -1487,7 +1765,41 @@ RTXProcessor::writeBlank(UFILE* out)
 }
 
 bool
-RTXProcessor::filterParseGraph()
+RTXProcessor::shouldForceFlush()
+{
+  if(maxPendingTokens > 0 && pendingTokens >= maxPendingTokens)
+  {
+    return true;
+  }
+  if(memoryBudget > 0 && pendingMemory() > memoryBudget)
+  {
+    // a forced flush always happens, so this can be counted here
+    budgetFlushCount++;
+    return true;
+  }
+  if(maxPendingMillis > 0)
+  {
+    auto waited = chrono::steady_clock::now() - pendingSince;
+    return chrono::duration_cast<chrono::milliseconds>(waited).count() >= maxPendingMillis;
+  }
+  return false;
+}
+
+size_t
+RTXProcessor::pendingMemory()
+{
+  size_t chunks = chunkPool.size();
+  size_t nodes = parsePool.size();
+  for(auto worker : branchWorkers)
+  {
+    chunks += worker->chunkPool.size();
+    nodes += worker->parsePool.size();
+  }
+  return chunks*sizeof(Chunk) + nodes*sizeof(ParseNode) + pendingChars*sizeof(UChar);
+}
+
+bool
+RTXProcessor::filterParseGraph(bool force)
 {
   if(printingAll)
   {
@@ -1497,17 +1809,40 @@ RTXProcessor::filterParseGraph()
     }
     else cerr << endl << "Filtering Branches:" << endl;
   }
-  bool shouldOutput = !furtherInput && inputBuffer.size() == 1;
+  bool shouldOutput = force || (!furtherInput && inputBuffer.size() == 1);
+  if(parseGraph.size() == 1 && !printingAll && !printingBranches &&
+     (shouldOutput || furtherInput || inputBuffer.size() > 1))
+  {
+    // the usual case: there is nothing to choose between,
+    // so the only question is whether to output, answered as below
+    // (at the end of the input with nothing buffered, the branch
+    // is left as it is, so that case goes the long way round)
+    return shouldOutput || parseGraph[0]->isDone() ||
+      (!parseGraph[0]->chunk->isBlank && !lookahead(mainContext, parseGraph[0]));
+  }
   int state[parseGraph.size()];
   const int N = parseGraph.size();
   memset(state, 1, N*sizeof(int));
   int count = N;
-  if(furtherInput || inputBuffer.size() > 1)
+  if(force)
+  {
+    // treat this like the end of the input
+    // and choose among all branches
+    if(printingAll)
+    {
+      if(treePrintMode == TreeModeLatex)
+      {
+        cerr << "\\item Pending input limit reached." << endl;
+      }
+      else cerr << "Pending input limit reached." << endl;
+    }
+  }
+  else if(furtherInput || inputBuffer.size() > 1)
   {
     for(int i = 0; i < N; i++)
     {
       if(parseGraph[i]->isDone() ||
-         (!parseGraph[i]->chunk->isBlank && !lookahead(parseGraph[i])))
+         (!parseGraph[i]->chunk->isBlank && !lookahead(mainContext, parseGraph[i])))
       {
         state[i] = 0;
         count--;
@@ -1671,7 +2006,7 @@ RTXProcessor::filterParseGraph()
 }
 
 void
-RTXProcessor::processGLR(UFILE *out)
+RTXProcessor::processGLR(OutputWriter* out)
 {
   int sentenceId = 1;
   if(printingAll && treePrintMode == TreeModeLatex)
@@ -1697,6 +2032,7 @@ RTXProcessor::processGLR(UFILE *out)
         // if a rule asks for a space
         // -D.S. 2020-09-21
         blankQueue.push_back(next->target);
+        pendingChars += next->target.size();
       }
     }
     if(printingAll)
@@ -1708,6 +2044,8 @@ RTXProcessor::processGLR(UFILE *out)
       cerr << endl;
     }
     inputBuffer.pop_front();
+    if(oldGenTokens > 0) oldGenTokens--;
+    prepareLookahead();
     if(parseGraph.size() == 0)
     {
       // skip parseGraph stuff if a blank is the only thing being processed
@@ -1726,33 +2064,68 @@ RTXProcessor::processGLR(UFILE *out)
         if(inputBuffer.empty())
         {
           cerr.flush();
-          u_fflush(out);
+          out->endUnit();
           break;
         }
         continue;
       }
+      pendingTokens = 1;
+      pendingChars = next->source.size() + next->target.size();
+      if(maxPendingMillis > 0)
+      {
+        pendingSince = chrono::steady_clock::now();
+      }
       ParseNode* temp = parsePool.next();
       temp->init(mx, next);
       temp->id = ++newBranchId;
       temp->stringVars = variables;
       temp->wblankVars = wblank_variables;
-      temp->chunkVars = vector<Chunk*>(varCount, NULL);
-      checkForReduce(parseGraph, temp);
+      temp->chunkVars = vector<Chunk*>(grammar->getVarCount(), NULL);
+      checkForReduce(mainContext, parseGraph, temp);
     }
     else
     {
-      mx->prepareChunk(next->source.size() > 0 ? next->source : next->target);
+      if(!next->isBlank)
+      {
+        pendingTokens++;
+        pendingChars += next->source.size() + next->target.size();
+      }
+      mx->prepareSymbols(next->source.size() > 0 ? next->source : next->target, nextSymbols);
       // conditional deals with unknowns
-      vector<ParseNode*> temp;
-      for(unsigned int i = 0, limit = parseGraph.size(); i < limit; i++)
+      vector<ParseNode*>& temp = nextParseGraph;
+      temp.clear();
+      unsigned int branchCount = parseGraph.size();
+      stepCount++;
+      if(branchCount == 1)
       {
-        ParseNode* tempNode = parsePool.next();
-        tempNode->init(parseGraph[i], next, true);
-        tempNode->id = parseGraph[i]->id;
-        tempNode->stringVars = parseGraph[i]->stringVars;
-        tempNode->wblankVars = parseGraph[i]->wblankVars;
-        tempNode->chunkVars = parseGraph[i]->chunkVars;
-        checkForReduce(temp, tempNode);
+        singleBranchStepCount++;
+        advanceBranch(mainContext, parseGraph[0], next, temp);
+      }
+      else if(branchThreads != NULL && branchCount >= branchThreshold &&
+         !printingAll && !printingRules && !printingSteps)
+      {
+        if(branchResults.size() < branchCount)
+        {
+          branchResults.resize(branchCount);
+        }
+        branchThreads->run(branchCount, [&](unsigned int worker, unsigned int i) {
+          branchResults[i].clear();
+          advanceBranch(branchWorkers[worker]->context, parseGraph[i], next, branchResults[i]);
+        });
+        for(unsigned int i = 0; i < branchCount; i++)
+        {
+          temp.insert(temp.end(), branchResults[i].begin(), branchResults[i].end());
+        }
+        parallelStepCount++;
+      }
+      else
+      {
+        sharingRules = (branchCount > 1);
+        for(unsigned int i = 0; i < branchCount; i++)
+        {
+          advanceBranch(mainContext, parseGraph[i], next, temp);
+        }
+        sharingRules = false;
       }
       parseGraph.swap(temp);
     }
@@ -1772,9 +2145,21 @@ RTXProcessor::processGLR(UFILE *out)
         }
       }
     }
-    if(furtherInput) inputBuffer.push_back(readToken());
-    if(filterParseGraph())
+    if(furtherInput)
+    {
+      inputBuffer.push_back(readToken());
+      prepareLookahead();
+    }
+    bool force = shouldForceFlush();
+    if(filterParseGraph(force))
     {
+      flushCount++;
+      if(force) forcedFlushCount++;
+      size_t used = pendingMemory();
+      if(used > peakPendingMemory)
+      {
+        peakPendingMemory = used;
+      }
       cerr.flush();
       if(printingAll)
       {
@@ -1801,7 +2186,7 @@ RTXProcessor::processGLR(UFILE *out)
           cerr << endl;
         }
       }
-      currentBranch = parseGraph[0];
+      mainContext.currentBranch = parseGraph[0];
       parseGraph[0]->getChunks(outputQueue, parseGraph[0]->length-1);
       parseGraph.clear();
 
@@ -1810,89 +2195,52 @@ RTXProcessor::processGLR(UFILE *out)
       // that didn't get a parse, reparse it disregarding context, so
       // we can at least use single-word rules on them.
       {
-        ParseNode* prevBranch = currentBranch;
+        ParseNode* prevBranch = mainContext.currentBranch;
+        if(reparseCacheSize > 0 &&
+           (variables != reparseCacheVars || wblank_variables != reparseCacheWblankVars))
+        {
+          clearReparseCache();
+          reparseCacheVars = variables;
+          reparseCacheWblankVars = wblank_variables;
+        }
         for(auto it = outputQueue.begin(); it != outputQueue.end();) {
           Chunk* ch = *it;
           if(ch->rule == -1 && !ch->isBlank) { // -1 means didn't get a parse
-            if(printingAll) cerr << "Reparsing chunk ^" << ch->source << "/" << ch->target << "$" << endl;
-            ParseNode* temp = parsePool.next();
-            temp->init(mx, ch);
-            temp->id = ++newBranchId;
-            temp->stringVars = variables;
-            temp->wblankVars = wblank_variables;
-            temp->chunkVars = vector<Chunk*>(varCount, NULL);
-            checkForReduce(parseGraph, temp);
-
             list<Chunk*> outputQueueReparsed;
-            parseGraph[0]->getChunks(outputQueueReparsed, parseGraph[0]->length-1);
+            reparseChunk(ch, outputQueueReparsed);
             it = outputQueue.erase(it); // skip current word since reparse includes it
             outputQueue.splice(it, outputQueueReparsed);
-            parseGraph.clear();
           }
           else {
               ++it;
           }
         }
-        currentBranch = prevBranch;
+        mainContext.currentBranch = prevBranch;
       }
 
       outputAll(out);
-      variables = currentBranch->stringVars;
-      wblank_variables = currentBranch->wblankVars;
-      u_fflush(out);
-      vector<UString> wblanks;
-      vector<UString> sources;
-      vector<UString> targets;
-      vector<UString> corefs;
-      vector<bool> blanks;
-      vector<bool> unknowns;
-      int N = inputBuffer.size();
-      for(int i = 0; i < N; i++)
-      {
-        Chunk* temp = inputBuffer.front();
-        if(temp->contents.size() > 0)
-        {
-          unknowns.push_back(true);
-          temp = temp->contents[0];
-        }
-        else
-        {
-          unknowns.push_back(false);
-        }
-        wblanks.push_back(temp->wblank);
-        sources.push_back(temp->source);
-        targets.push_back(temp->target);
-        corefs.push_back(temp->coref);
-        blanks.push_back(temp->isBlank);
-        inputBuffer.pop_front();
+      variables = mainContext.currentBranch->stringVars;
+      wblank_variables = mainContext.currentBranch->wblankVars;
+      out->endUnit();
+      // the tokens remaining in inputBuffer don't come from chunkPool
+      // so they can be left where they are
+      if(oldGenTokens == 0)
+      {
+        tokenGen = 1 - tokenGen;
+        tokenPool[tokenGen].reset();
+        lookaheadToken = NULL;
+        oldGenTokens = inputBuffer.size();
       }
       //cerr << "clearing chunkPool, size was " << chunkPool.size() << endl;
       //cerr << "clearing parsePool, size was " << parsePool.size() << endl;
-      chunkPool.reset();
-      parsePool.reset();
+      clearRuleMemo();
+      resetPools();
       newBranchId = 0;
       if(printingAll) sentenceId++;
       if((furtherInput || inputBuffer.size() > 1) && printingAll && treePrintMode == TreeModeLatex)
       {
         cerr << endl << endl << "\\section{Sentence " << sentenceId << "}" << endl << endl;
       }
-      for(int i = 0; i < N; i++)
-      {
-        Chunk* c = chunkPool.next();
-        c->wblank = wblanks[i];
-        c->source = sources[i];
-        c->target = targets[i];
-        c->coref = corefs[i];
-        c->isBlank = blanks[i];
-        if(unknowns[i])
-        {
-          Chunk* c2 = chunkPool.next();
-          c2->target = targets[i].substr(1) + "<UNKNOWN:INTERNAL>"_u;
-          c2->contents.push_back(c);
-          c = c2;
-        }
-        inputBuffer.push_back(c);
-      }
     }
     printingAll = real_printingAll;
     if(!furtherInput && inputBuffer.size() == 1)
@@ -1902,7 +2250,7 @@ RTXProcessor::processGLR(UFILE *out)
       inputBuffer.front()->output(out);
       blankQueue.clear();
       inputBuffer.pop_front();
-      u_fflush(out);
+      out->endUnit();
       break;
     }
     else if(!furtherInput && inputBuffer.size() == 0) break;
@@ -1910,7 +2258,8 @@ RTXProcessor::processGLR(UFILE *out)
 }
 
 void
-RTXProcessor::processTRXLayer(list<Chunk*>& t1x, list<Chunk*>& t2x)
+RTXProcessor::processTRXLayer(ParseContext& ctx, list<Chunk*>& t1x, list<Chunk*>& t2x,
+                              bool moreInput, bool outputWaiting)
 {
   if(t1x.size() == 0)
   {
@@ -1919,9 +2268,9 @@ RTXProcessor::processTRXLayer(list<Chunk*>& t1x, list<Chunk*>& t2x)
   int state[1024];
   int first = 0;
   int last = 0;
-  if(!furtherInput || t1x.size() >= longestPattern)
+  if(!moreInput || t1x.size() >= grammar->getLongestPattern())
   {
-    mx->resetRejected();
+    ctx.rejected.clear();
     unsigned int len = 0;
     int rule = -1;
     unsigned int i = 0;
@@ -1930,7 +2279,7 @@ RTXProcessor::processTRXLayer(list<Chunk*>& t1x, list<Chunk*>& t2x)
     last = 1;
     state[0] = mx->getInitial();
     for(list<Chunk*>::iterator it = t1x.begin(), limit = t1x.end();
-          it != limit && i < longestPattern; it++)
+          it != limit && i < grammar->getLongestPattern(); it++)
     {
       i++;
       if((*it)->isBlank)
@@ -1940,7 +2289,7 @@ RTXProcessor::processTRXLayer(list<Chunk*>& t1x, list<Chunk*>& t2x)
       else
       {
         mx->matchChunk(state, first, last, (*it)->matchSurface(), false);
-        int r = mx->getRule(state, first, last).first;
+        int r = mx->getRule(state, first, last, ctx.rejected.data(), ctx.rejected.size()).first;
         if(r != -1)
         {
           rule = r;
@@ -1955,9 +2304,11 @@ RTXProcessor::processTRXLayer(list<Chunk*>& t1x, list<Chunk*>& t2x)
       if(!t2x.back()->isBlank && t2x.back()->target.size() == 0)
       {
         t2x.pop_back();
-        if(t2x.size() > 0 && t1x.size() > 0)
+        if((t2x.size() > 0 || outputWaiting) && t1x.size() > 0)
         {
-          t2x.back()->target += t1x.front()->target;
+          // this used to append the empty target to t2x.back(),
+          // which changes nothing, so all that is left is dropping
+          // whatever follows the empty LU
           t1x.pop_front();
         }
       }
@@ -1966,32 +2317,32 @@ RTXProcessor::processTRXLayer(list<Chunk*>& t1x, list<Chunk*>& t2x)
     else
     {
       i = 0;
-      currentInput.resize(len);
+      ctx.currentInput.resize(len);
       for(list<Chunk*>::iterator it = t1x.begin(), limit = t1x.end();
             it != limit && i < len; it++)
       {
-        currentInput[i] = *it;
+        ctx.currentInput[i] = *it;
         i++;
       }
-      currentOutput.clear();
+      ctx.currentOutput.clear();
       if(printingRules) {
         cerr << endl << "Applying rule " << rule;
-        if(rule <= (int)inRuleNames.size())
+        if(rule <= (int)grammar->inputRuleNames().size())
         {
-          cerr << " (" << inRuleNames[rule-1] << ")";
+          cerr << " (" << grammar->inputRuleNames()[rule-1] << ")";
         }
         cerr << ": ";
-        for(unsigned int i = 0; i < currentInput.size(); i++)
+        for(unsigned int i = 0; i < ctx.currentInput.size(); i++)
         {
-          currentInput[i]->writeTree(TreeModeFlat, NULL);
+          ctx.currentInput[i]->writeTree(TreeModeFlat, NULL);
         }
         cerr << endl;
       }
-      if(applyRule(rule_map[rule-1]))
+      if(applyRule(ctx, grammar->inputRule(rule)))
       {
-        for(unsigned int n = 0; n < currentOutput.size(); n++)
+        for(unsigned int n = 0; n < ctx.currentOutput.size(); n++)
         {
-          t2x.push_back(currentOutput[n]);
+          t2x.push_back(ctx.currentOutput[n]);
         }
         for(unsigned int n = 0; n < len; n++)
         {
@@ -2007,82 +2358,515 @@ RTXProcessor::processTRXLayer(list<Chunk*>& t1x, list<Chunk*>& t2x)
 }
 
 void
-RTXProcessor::processTRX(UFILE *out)
+RTXProcessor::outputTRX(list<Chunk*>& t3x, OutputWriter* out)
+{
+  while(t3x.size() > 0)
+  {
+    Chunk* cur = t3x.front();
+    t3x.pop_front();
+    vector<UString> tags = cur->getTags(vector<UString>());
+    if(cur->rule == -1)
+    {
+      if(cur->contents.size() == 0) cur->output(out);
+      else
+      {
+        while(cur->contents.size() > 0)
+        {
+          t3x.push_front(cur->contents.back());
+          t3x.front()->updateTags(tags);
+          cur->contents.pop_back();
+        }
+      }
+    }
+    else
+    {
+      if(printingRules) {
+        cerr << endl << "Applying output rule " << cur->rule;
+        if(cur->rule < (int)grammar->outputRuleNames().size())
+        {
+          cerr << " (" << grammar->outputRuleNames()[cur->rule] << ")";
+        }
+        cerr << ": ";
+        cur->writeTree(TreeModeFlat, NULL);
+        cerr << endl;
+      }
+      mainContext.parentChunk = cur;
+      mainContext.currentInput = cur->contents;
+      for(unsigned int i = 0; i < mainContext.currentInput.size(); i++)
+      {
+        mainContext.currentInput[i]->updateTags(tags);
+      }
+      mainContext.currentOutput.clear();
+      applyRule(mainContext, grammar->outputRule(cur->rule));
+      for(unsigned int i = 0; i < mainContext.currentOutput.size(); i++)
+      {
+        mainContext.currentOutput[i]->output(out);
+      }
+    }
+  }
+}
+
+void
+RTXProcessor::processTRX(OutputWriter* out)
 {
+  // rule traces from several threads would be interleaved
+  if(layerThreads && !printingRules && !printingSteps)
+  {
+    // the layer threads can't be stopped part way through
+    exitOnError([&]{ processTRXLayered(out); });
+    return;
+  }
   list<Chunk*> t1x;
   list<Chunk*> t2x;
   list<Chunk*> t3x;
+  int liveChunks = 0;
   while(furtherInput || t1x.size() > 0 || t2x.size() > 0)
   {
-    while(furtherInput && t1x.size() < 2*longestPattern)
+    while(furtherInput && t1x.size() < 2*grammar->getLongestPattern())
     {
       t1x.push_back(readToken());
     }
     if(furtherInput)
     {
-      processTRXLayer(t1x, t2x);
-      processTRXLayer(t2x, t3x);
+      processTRXLayer(mainContext, t1x, t2x, true);
+      processTRXLayer(mainContext, t2x, t3x, true);
     }
     else
     {
       while(t1x.size() > 0)
       {
-        processTRXLayer(t1x, t2x);
+        processTRXLayer(mainContext, t1x, t2x, false);
       }
       while(t2x.size() > 0)
       {
-        processTRXLayer(t2x, t3x);
+        processTRXLayer(mainContext, t2x, t3x, false);
       }
     }
-    while(t3x.size() > 0)
+    outputTRX(t3x, out);
+    // without null flush, nothing else would ever free these pools
+    if(chunkPool.size() + tokenPool[tokenGen].size() - liveChunks >= (int)compactionInterval)
+    {
+      compactTRX({&t1x, &t2x});
+      liveChunks = tokenPool[tokenGen].size();
+    }
+  }
+}
+
+static void
+pushLayerItem(SpscQueue<LayerItem>* queue, LayerItemKind kind, Chunk* ch)
+{
+  LayerItem& item = queue->startPush();
+  item.kind = kind;
+  item.chunk = ch;
+  queue->finishPush();
+}
+
+void
+RTXProcessor::sendLayerOutput(list<Chunk*>& produced, SpscQueue<LayerItem>* next)
+{
+  while(produced.size() > 0)
+  {
+    pushLayerItem(next, LayerChunk, produced.front());
+    produced.pop_front();
+  }
+}
+
+void
+RTXProcessor::requestCompaction(SpscQueue<LayerItem>* next)
+{
+  unsigned long generation;
+  {
+    lock_guard<mutex> guard(compactLock);
+    generation = compactGeneration;
+  }
+  pushLayerItem(next, LayerCompact, NULL);
+  unique_lock<mutex> guard(compactLock);
+  compactDone.wait(guard, [&]{ return compactGeneration != generation; });
+}
+
+void
+RTXProcessor::runFirstLayer()
+{
+  TRXLayer& layer = trxLayers[0];
+  int liveChunks = 0;
+  unsigned long steps = 0;
+  size_t sent = 0;
+  while(furtherInput || layer.pending.size() > 0)
+  {
+    while(furtherInput && layer.pending.size() < 2*grammar->getLongestPattern())
+    {
+      layer.pending.push_back(readToken());
+    }
+    // whether an empty LU that no rule matches takes the next chunk
+    // with it depends on whether processTRX() would have anything left
+    // in t2x, so wait for the second layer to catch up and find out
+    bool outputWaiting = false;
+    if(layer.pending.size() > 0 && !layer.pending.front()->isBlank &&
+       layer.pending.front()->target.size() == 0)
+    {
+      unique_lock<mutex> guard(layerStepLock);
+      layerStepDone.wait(guard, [&]{ return layerStepsDone == steps; });
+      outputWaiting = (sent > layerChunksConsumed);
+    }
+    processTRXLayer(layer.context, layer.pending, layer.produced, furtherInput, outputWaiting);
+    sent += layer.produced.size();
+    sendLayerOutput(layer.produced, layerQueues[0]);
+    if(furtherInput)
+    {
+      pushLayerItem(layerQueues[0], LayerStep, NULL);
+      steps++;
+    }
+    // only this thread's allocations are counted, but the other stages
+    // allocate in proportion to them
+    if(tokenPool[tokenGen].size() + layer.chunkPool.size() - liveChunks >= (int)compactionInterval)
+    {
+      requestCompaction(layerQueues[0]);
+      liveChunks = tokenPool[tokenGen].size();
+    }
+  }
+  pushLayerItem(layerQueues[0], LayerEnd, NULL);
+}
+
+void
+RTXProcessor::runSecondLayer()
+{
+  TRXLayer& layer = trxLayers[1];
+  // step when processTRX() would, so that every match
+  // sees the same chunks in the same state
+  while(true)
+  {
+    LayerItem& item = layerQueues[0]->front();
+    LayerItemKind kind = item.kind;
+    Chunk* ch = item.chunk;
+    layerQueues[0]->pop();
+    if(kind == LayerChunk)
+    {
+      layer.pending.push_back(ch);
+    }
+    else if(kind == LayerCompact)
+    {
+      requestCompaction(layerQueues[1]);
+    }
+    else if(kind == LayerEnd)
+    {
+      break;
+    }
+    else
+    {
+      // processTRX() writes out all of t3x before each step
+      size_t before = layer.pending.size();
+      processTRXLayer(layer.context, layer.pending, layer.produced, true);
+      sendLayerOutput(layer.produced, layerQueues[1]);
+      lock_guard<mutex> guard(layerStepLock);
+      layerStepsDone++;
+      layerChunksConsumed += before - layer.pending.size();
+      layerStepDone.notify_all();
+    }
+  }
+  // once the input has ended, processTRX() applies this layer
+  // to everything that is left before writing any of it
+  size_t sent = 0;
+  while(layer.pending.size() > 0)
+  {
+    processTRXLayer(layer.context, layer.pending, layer.produced, false, sent > 0);
+    sent += layer.produced.size();
+    sendLayerOutput(layer.produced, layerQueues[1]);
+  }
+  pushLayerItem(layerQueues[1], LayerEnd, NULL);
+}
+
+void
+RTXProcessor::processTRXLayered(OutputWriter* out)
+{
+  for(auto& queue : layerQueues)
+  {
+    queue = new SpscQueue<LayerItem>(layerQueueSize);
+  }
+  layerStepsDone = 0;
+  layerChunksConsumed = 0;
+  thread first(exitOnError, [this]{ runFirstLayer(); });
+  thread second(exitOnError, [this]{ runSecondLayer(); });
+  list<Chunk*> t3x;
+  while(true)
+  {
+    LayerItem& item = layerQueues[1]->front();
+    LayerItemKind kind = item.kind;
+    Chunk* ch = item.chunk;
+    layerQueues[1]->pop();
+    if(kind == LayerEnd)
+    {
+      break;
+    }
+    else if(kind == LayerCompact)
+    {
+      // both layers are waiting for this and the queues are empty,
+      // so the chunks they still hold are the only ones that matter
+      compactTRX({&trxLayers[0].pending, &trxLayers[0].produced,
+                  &trxLayers[1].pending, &trxLayers[1].produced});
+      lock_guard<mutex> guard(compactLock);
+      compactGeneration++;
+      compactDone.notify_all();
+    }
+    else
     {
-      Chunk* cur = t3x.front();
-      t3x.pop_front();
-      vector<UString> tags = cur->getTags(vector<UString>());
-      if(cur->rule == -1)
+      t3x.push_back(ch);
+      outputTRX(t3x, out);
+    }
+  }
+  first.join();
+  second.join();
+  for(auto& queue : layerQueues)
+  {
+    layerQueueEmptyWaits += queue->consumerWaits();
+    layerQueueFullWaits += queue->producerWaits();
+    delete queue;
+    queue = NULL;
+  }
+}
+
+void
+RTXProcessor::processSegment(OutputWriter* out)
+{
+  furtherInput = true;
+  if(isLinear)
+  {
+    processTRX(out);
+  }
+  else
+  {
+    processGLR(out);
+  }
+  clearRuleMemo();
+  resetPools();
+  tokenPool[0].reset();
+  tokenPool[1].reset();
+  lookaheadToken = NULL;
+  oldGenTokens = 0;
+  inputBuffer.clear();
+  // I'm not sure how the leading blank after a null gets into inputBuffer,
+  // but it does and clearing the buffer seems to fix the problem
+  // (in theory, clearing the buffer here should have no effect at all
+  // because processGLR() should consume everything in it)
+  // - D.S. Aug 26 2020
+}
+
+void
+RTXProcessor::discardSegment()
+{
+  parseGraph.clear();
+  outputQueue.clear();
+  blankQueue.clear();
+  pendingTokens = 0;
+  pendingChars = 0;
+  clearRuleMemo();
+  resetPools();
+  tokenPool[0].reset();
+  tokenPool[1].reset();
+  lookaheadToken = NULL;
+  oldGenTokens = 0;
+  inputBuffer.clear();
+}
+
+/**
+ * Append length followed by length bytes of data, if data isn't NULL
+ */
+static void
+appendKeyPart(string& key, const char* data, size_t length)
+{
+  key.append((const char*)&length, sizeof(length));
+  if(data != NULL)
+  {
+    key.append(data, length);
+  }
+}
+
+void
+RTXProcessor::processCachedSegments(FILE* in, OutputWriter* out)
+{
+  string segment;
+  string segmentOutput;
+  string key;
+  segmentReader.wrap(in);
+  while(!segmentReader.eof())
+  {
+    segment.clear();
+    segmentReader.readSegment(segment);
+
+    // the output can depend on global variables set by earlier segments
+    // each part is preceded by its length, since any byte can occur in them
+    key.clear();
+    appendKeyPart(key, segment.data(), segment.size());
+    for(auto vars : {&variables, &wblank_variables})
+    {
+      appendKeyPart(key, NULL, vars->size());
+      for(auto& it : *vars)
       {
-        if(cur->contents.size() == 0) cur->output(out);
-        else
-        {
-          while(cur->contents.size() > 0)
-          {
-            t3x.push_front(cur->contents.back());
-            t3x.front()->updateTags(tags);
-            cur->contents.pop_back();
-          }
-        }
+        appendKeyPart(key, (const char*)it.first.data(), it.first.size()*sizeof(UChar));
+        appendKeyPart(key, (const char*)it.second.data(), it.second.size()*sizeof(UChar));
       }
-      else
+    }
+
+    auto entry = segmentCacheIndex.find(key);
+    if(entry != segmentCacheIndex.end())
+    {
+      segmentCacheHits++;
+      segmentCache.splice(segmentCache.begin(), segmentCache, entry->second);
+      SegmentCacheEntry& result = entry->second->second;
+      out->writeBytes(result.output.data(), result.output.size());
+      variables = result.variables;
+      wblank_variables = result.wblankVariables;
+    }
+    else
+    {
+      segmentCacheMisses++;
+      // readToken() stops at \0 in null flush mode,
+      // so this behaves exactly like reading from in
+      segment += '\0';
+      processUnit(segment, segmentOutput);
+
+      out->writeBytes(segmentOutput.data(), segmentOutput.size());
+      if(segment.size() <= maxCachedSegmentLength)
       {
-        if(printingRules) {
-          cerr << endl << "Applying output rule " << cur->rule;
-          if(cur->rule < (int)outRuleNames.size())
-          {
-            cerr << " (" << outRuleNames[cur->rule] << ")";
-          }
-          cerr << ": ";
-          cur->writeTree(TreeModeFlat, NULL);
-          cerr << endl;
-        }
-        parentChunk = cur;
-        currentInput = cur->contents;
-        for(unsigned int i = 0; i < currentInput.size(); i++)
+        segmentCache.push_front(make_pair(key, SegmentCacheEntry()));
+        SegmentCacheEntry& result = segmentCache.front().second;
+        result.output = segmentOutput;
+        result.variables = variables;
+        result.wblankVariables = wblank_variables;
+        segmentCacheIndex[key] = segmentCache.begin();
+        if(segmentCache.size() > segmentCacheSize)
         {
-          currentInput[i]->updateTags(tags);
-        }
-        currentOutput.clear();
-        applyRule(output_rules[cur->rule]);
-        for(unsigned int i = 0; i < currentOutput.size(); i++)
-        {
-          currentOutput[i]->output(out);
+          segmentCacheIndex.erase(segmentCache.back().first);
+          segmentCache.pop_back();
         }
       }
     }
+    out->endSegment();
+  }
+}
+
+void
+RTXProcessor::processUnit(const string& input, OutputWriter* out)
+{
+  applyConstantMemory();
+  if(input.empty())
+  {
+    return;
+  }
+  // the stream is only read from, so the cast is harmless
+  FILE* unitIn = fmemopen(const_cast<char*>(input.data()), input.size(), "rb");
+  if(unitIn == NULL)
+  {
+    throw runtime_error("Unable to allocate buffers for input unit.");
+  }
+  infile.wrap(unitIn);
+  try
+  {
+    processSegment(out);
+  }
+  catch(...)
+  {
+    discardSegment();
+    fclose(unitIn);
+    throw;
   }
+  out->flush();
+  fclose(unitIn);
+}
+
+void
+RTXProcessor::processUnit(const string& input, string& output)
+{
+  output.clear();
+  OutputWriter captured(&output);
+  captured.setFlushPolicy(FlushOnNull);
+  processUnit(input, &captured);
+}
+
+void
+RTXProcessor::resetVariables()
+{
+  variables = grammar->initialVariables();
+  wblank_variables.clear();
 }
 
 void
-RTXProcessor::process(FILE* in, UFILE* out)
+RTXProcessor::applyConstantMemory()
+{
+  if(constantMemory)
+  {
+    if(memoryBudget == 0)
+    {
+      memoryBudget = defaultMemoryBudget;
+    }
+    if(poolRetainBuckets == 0)
+    {
+      setPoolRetainBuckets(32);
+    }
+  }
+}
+
+void
+RTXProcessor::readTokens()
+{
+  while(true)
+  {
+    QueuedToken& q = tokenQueue->startPush();
+    q.kind = infile.next(q.token);
+    q.last = (q.kind == TokenEnd && infile.eof());
+    bool last = q.last;
+    tokenQueue->finishPush();
+    if(last) return;
+  }
+}
+
+void
+RTXProcessor::startTokenThread()
+{
+  inputEnded = false;
+  tokenQueue = new SpscQueue<QueuedToken>(tokenQueueSize);
+  tokenThread = new thread(exitOnError, [this]{ readTokens(); });
+}
+
+void
+RTXProcessor::stopTokenThread()
+{
+  if(tokenThread == NULL)
+  {
+    return;
+  }
+  tokenThread->join();
+  tokenQueueEmptyWaits += tokenQueue->consumerWaits();
+  tokenQueueFullWaits += tokenQueue->producerWaits();
+  delete tokenThread;
+  delete tokenQueue;
+  tokenThread = NULL;
+  tokenQueue = NULL;
+}
+
+TokenKind
+RTXProcessor::nextToken()
+{
+  if(tokenQueue == NULL)
+  {
+    return infile.next(token);
+  }
+  QueuedToken& q = tokenQueue->front();
+  // swapping hands the storage of the previous token back to the tokenizer
+  swap(token, q.token);
+  TokenKind kind = q.kind;
+  inputEnded = q.last;
+  tokenQueue->pop();
+  return kind;
+}
+
+bool
+RTXProcessor::atEnd()
+{
+  return (tokenQueue != NULL ? inputEnded : infile.eof());
+}
+
+void
+RTXProcessor::process(FILE* in, OutputWriter* out)
 {
   if(printingAll && treePrintMode == TreeModeLatex)
   {
@@ -2093,42 +2877,48 @@ RTXProcessor::process(FILE* in, UFILE* out)
     cerr << "\\usepackage[cm]{fullpage}" << endl << endl;
     cerr << "\\begin{document}" << endl << endl;
   }
-  infile.wrap(in);
-  if(null_flush)
+  applyConstantMemory();
+  // the cache splits the text of the input into segments and replays output bytes,
+  // neither of which works with the binary stream format
+  if(null_flush && segmentCacheSize > 0 &&
+     !infile.isBinary() && !out->isBinary() &&
+     !printingAll && !printingRules && !printingSteps && !printingBranches)
   {
-    while(!infile.eof())
+    processCachedSegments(in, out);
+  }
+  else
+  {
+    infile.wrap(in);
+    if(pipelined)
     {
-      furtherInput = true;
-      if(isLinear)
-      {
-        processTRX(out);
-      }
-      else
+      startTokenThread();
+    }
+    if(null_flush)
+    {
+      while(!atEnd())
       {
-        processGLR(out);
+        processSegment(out);
+        out->endSegment();
       }
-      u_fputc('\0', out);
-      u_fflush(out);
-      chunkPool.reset();
-      parsePool.reset();
-      inputBuffer.clear();
-      // I'm not sure how the leading blank after a null gets into inputBuffer,
-      // but it does and clearing the buffer seems to fix the problem
-      // (in theory, clearing the buffer here should have no effect at all
-      // because processGLR() should consume everything in it)
-      // - D.S. Aug 26 2020
     }
+    else if(isLinear)
+    {
+      processTRX(out);
+    }
+    else
+    {
+      processGLR(out);
+    }
+    stopTokenThread();
   }
-  else if(isLinear)
-  {
-    processTRX(out);
-  }
-  else
-  {
-    processGLR(out);
-  }
+  out->flush();
   if(printingAll && treePrintMode == TreeModeLatex)
   {
     cerr << endl << endl << "\\end{document}" << endl;
   }
+  if(printingStats)
+  {
+    printStatistics();
+    cerr << "Output writes: " << out->writes() << endl;
+  }
 }
@@ -2,20 +2,44 @@
 #define __RTXPROCESSOR__
 
 #include <rtx_config.h>
-#include <apertium/apertium_re.h>
-#include <lttoolbox/alphabet.h>
+#include <compiled_grammar.h>
 #include <matcher.h>
 #include <chunk.h>
 #include <pool.h>
-#include <lttoolbox/input_file.h>
-
+#include <ring_buffer.h>
+#include <spsc_queue.h>
+#include <thread_pool.h>
+#include <token_reader.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
+#include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
 
+/**
+ * Allocators for the two types that are created in bulk
+ * Bucket sizes are chosen so that each bucket is roughly 100KB
+ */
+typedef Pool<Chunk, 512> ChunkPool;
+typedef Pool<ParseNode, 128> ParseNodePool;
+
+/**
+ * Call f, and if it throws std::runtime_error, print the message and exit
+ * For threads that only rtx-proc starts, whose errors there is
+ * nobody to pass on to
+ */
+void exitOnError(const function<void()>& f);
+
 struct StackElement
 {
   int mode;
@@ -25,137 +49,352 @@ struct StackElement
   Chunk* c;
 };
 
-class RTXProcessor
+/**
+ * Result of processing a null-flushed segment, as stored in the segment cache
+ */
+struct SegmentCacheEntry
 {
-private:
+  string output;
+  map<UString, UString> variables;
+  map<UString, UString> wblankVariables;
+};
 
-  //////////
-  // DATA
-  //////////
+/**
+ * A token read ahead on the tokenizer thread
+ * last is set on the TokenEnd at the end of the input
+ */
+struct QueuedToken
+{
+  TokenKind kind;
+  Token token;
+  bool last;
+};
 
+/**
+ * What is passed between rule layers when they run on separate threads
+ * LayerStep ends the chunks from each step the first layer takes while
+ * more input may follow, and the second layer takes one step for each,
+ * LayerCompact asks every later stage to wait while the pools are compacted
+ * and LayerEnd follows the last chunk
+ */
+enum LayerItemKind
+{
+  LayerChunk,
+  LayerStep,
+  LayerCompact,
+  LayerEnd
+};
+
+struct LayerItem
+{
+  LayerItemKind kind;
+  Chunk* chunk;
+};
+
+/**
+ * Result of applying an input-time rule, shared between branches
+ * that apply the same rule to the same chunks
+ * varWrites holds the (name, value, wblank) triples of each SETVAR
+ * so that they can be repeated on each branch
+ */
+struct RuleMemo
+{
+  bool accepted;
+  vector<Chunk*> output;
+  vector<UString> varWrites;
+  UString outWblank;
+};
+
+/**
+ * Pending work for checkForReduce()
+ * node is checked for reductions, or if fork is true, kept unreduced
+ * as well, because it can shift the next token
+ * cont and pos give the position in currentContinuations of the next
+ * chunk to be shifted once no further reductions are possible
+ */
+struct ReduceItem
+{
+  ParseNode* node;
+  int cont;
+  int pos;
+  bool fork;
+};
+
+/**
+ * Output nodes past the first of a rule that produced several nodes
+ * These are shifted onto each branch resulting from the first node
+ * and once they are used up, processing resumes at parentPos in parent
+ */
+struct ReduceContinuation
+{
+  int parent;
+  int parentPos;
+  int begin;
+  int end;
+  int firstWord;
+  int lastWord;
+};
+
+/**
+ * Working state of the virtual machine and of checkForReduce()
+ * Branches can be advanced on several threads at once, each of which
+ * needs its own copy of this, so none of it lives in RTXProcessor itself
+ */
+struct ParseContext
+{
   /**
-   * Alphabet instance for the pattern transducer
+   * The stack used by the virtual machine
+   * The stack size is set to 32 because a rule would only go higher than
+   * roughly 10 if it was evaluating a very complex conditional,
+   * so 32 is probably more than anyone will ever need
    */
-  Alphabet alphabet;
+  StackElement theStack[32];
 
   /**
-   * The pattern transducer
+   * Index of the top element on theStack
+   */
+  int stackIdx = 0;
+  
+  /**
+   * A parallel stack to store wordbound blanks that mimics the operations
+   * of the main stack. wblanks are added everytime lemmas are clipped
    */
-  MatchExe2 *mx;
+  UString theWblankStack[32];
+  
+  /**
+   * wordbound blank to be output
+   */
+  UString out_wblank;
 
   /**
-   * Attribute category regular expressions
+   * Input to the virtual machine
+   * currentInput is global rather than a parameter mostly for symmetry
+   * with currentOutput
    */
-  map<UString, ApertiumRE> attr_items;
+  vector<Chunk*> currentInput;
 
   /**
-   * Virtual machine global variables
-   * name => value
+   * Output from the virtual machine
+   * The return value of the virtual machine is whether or not the rule was
+   * rejected, and passing data by semi-global array saves some amount of
+   * allocating and copying
    */
-  map<UString, UString> variables;
-  
+  vector<Chunk*> currentOutput;
+
   /**
-   * Virtual machine global variables to wblank map
-   * name => value
+   * Chunk containing currentInput for output-time rules
    */
-  map<UString, UString> wblank_variables;
+  Chunk* parentChunk = NULL;
 
   /**
-   * Lists
-   * name => { values }
+   * Branch of parseGraph currently being operated on
+   * Needed by applyRule() for FETCHCHUNK and SETCHUNK
    */
-  map<UString, set<UString>> lists;
+  ParseNode* currentBranch = nullptr;
 
   /**
-   * Lists, but all values are converted to lower case
-   * Used for case-insensitive comparison
-   * name => { values }
+   * If not NULL, SETVAR appends its name, value, and wblank here
    */
-  map<UString, set<UString>> listslow;
+  vector<UString>* varWriteLog = NULL;
 
   /**
-   * Bytecode for input-time rules
+   * Worklist used by checkForReduce()
+   * Items are processed last in, first out, so branches are produced
+   * in the same order as a depth-first traversal of the possible reductions
+   * Kept here so that its storage is reused between calls
    */
-  vector<UString> rule_map;
+  vector<ReduceItem> reduceQueue;
 
   /**
-   * Bytecode for output-time rules
+   * Pseudo-input buffers used by checkForReduce()
+   * Rules that output a single node are processed immediately
+   * but when rules output multiple nodes, treating them as input
+   * necessitates that reductions could happen, so any output past the first
+   * node is appended to continuationChunks and a ReduceContinuation
+   * recording that range is appended to currentContinuations
+   * Both are cleared at the start of each call to checkForReduce()
    */
-  vector<UString> output_rules;
+  vector<ReduceContinuation> currentContinuations;
+  vector<Chunk*> continuationChunks;
 
   /**
-   * Debug names for input-time rules (may be empty)
+   * Elements of currentInput that applyRule() has copied for SETCLIP
    */
-  vector<UString> inRuleNames;
+  vector<bool> editted;
 
   /**
-   * Debug names for output-time rules (may be empty)
+   * Rules rejected so far for the node being checked by checkForReduce()
    */
-  vector<UString> outRuleNames;
+  vector<int> rejected;
 
   /**
-   * Length of pattern of each input-time rule, including blanks
+   * Allocators for the Chunks and ParseNodes created using this context
+   * Both are freed on output flush
    */
-  vector<int> pat_size;
+  ChunkPool* chunkPool = NULL;
+  ParseNodePool* parsePool = NULL;
 
   /**
-   * Maximum value of pat_size
+   * Pop and return a boolean from theStack
+   * Throw std::runtime_error if top element is not a bool
    */
-  unsigned int longestPattern;
+  bool popBool();
 
   /**
-   * Number of Chunk* global variables
+   * Pop and return an integer from theStack
+   * Throw std::runtime_error if top element is not an int
    */
-  unsigned int varCount;
+  int popInt();
 
   /**
-   * false if EOF or \0 has been reached in the input stream, true otherwise
+   * Pop and return a UString from theStack
+   * Throw std::runtime_error if top element is not a UString
    */
-  bool furtherInput = true;
+  UString popString();
 
   /**
-   * The stack used by the virtual machine
-   * The stack size is set to 32 because a rule would only go higher than
-   * roughly 10 if it was evaluating a very complex conditional,
-   * so 32 is probably more than anyone will ever need
+   * Equivalent to popString(), but with called as
+   * UString x; popString(x);
+   * rather than
+   * UString x = popString();
+   * This uses a swap to save an allocation and a copy, which is almost twice
+   * as fast, which has a noticeable impact on overall speed
    */
-  StackElement theStack[32];
+  void popString(UString& dest);
 
   /**
-   * Index of the top element on theStack
+   * Pop and return a Chunk pointer from theStack
+   * Throw std::runtime_error if top element is not a Chunk*
    */
-  int stackIdx;
-  
+  Chunk* popChunk();
+
+  inline void pushStack(bool b)
+  {
+    theStack[++stackIdx].mode = 0;
+    theStack[stackIdx].b = b;
+    theWblankStack[stackIdx].clear();
+  }
+  inline void pushStack(int i)
+  {
+    theStack[++stackIdx].mode = 1;
+    theStack[stackIdx].i = i;
+    theWblankStack[stackIdx].clear();
+  }
+  inline void pushStack(const UString& s, UString wbl = ""_u)
+  {
+    theStack[++stackIdx].mode = 2;
+    theStack[stackIdx].s.assign(s);
+    theWblankStack[stackIdx] = wbl;
+  }
+  inline void pushStack(Chunk* c)
+  {
+    theStack[++stackIdx].mode = 3;
+    theStack[stackIdx].c = c;
+    theWblankStack[stackIdx].clear();
+  }
+
   /**
-   * A parallel stack to store wordbound blanks that mimics the operations
-   * of the main stack. wblanks are added everytime lemmas are clipped
+   * Copy the contents of theStack[src] to theStack[dest]
    */
-  UString theWblankStack[32];
+  void stackCopy(int src, int dest);
+};
+
+/**
+ * A ParseContext together with the allocators it uses
+ * One of these exists for each thread that advances branches in parallel
+ */
+struct BranchWorker
+{
+  ParseContext context;
+  ChunkPool chunkPool;
+  ParseNodePool parsePool;
+  BranchWorker()
+  {
+    context.chunkPool = &chunkPool;
+    context.parsePool = &parsePool;
+  }
+};
+
+/**
+ * A rule layer of processTRX() running on its own thread
+ * pending is the input waiting to be matched and produced is output
+ * not yet passed on, both of which are relocated by compaction
+ */
+struct TRXLayer
+{
+  ParseContext context;
+  ChunkPool chunkPool;
+  list<Chunk*> pending;
+  list<Chunk*> produced;
+  TRXLayer()
+  {
+    context.chunkPool = &chunkPool;
+  }
+};
+
+class RTXProcessor
+{
+private:
+
+  //////////
+  // DATA
+  //////////
+
+  /**
+   * The grammar, which may be shared with other RTXProcessors
+   */
+  shared_ptr<const CompiledGrammar> grammar;
+
+  /**
+   * The pattern transducer of grammar
+   */
+  const MatchExe2* mx = NULL;
+
+  /**
+   * Virtual machine global variables
+   * name => value
+   */
+  map<UString, UString> variables;
   
   /**
-   * wordbound blank to be output
+   * Virtual machine global variables to wblank map
+   * name => value
    */
-  UString out_wblank;
+  map<UString, UString> wblank_variables;
 
   /**
-   * Input to the virtual machine
-   * currentInput is global rather than a parameter mostly for symmetry
-   * with currentOutput
+   * false if EOF or \0 has been reached in the input stream, true otherwise
    */
-  vector<Chunk*> currentInput;
+  bool furtherInput = true;
 
   /**
-   * Output from the virtual machine
-   * The return value of the virtual machine is whether or not the rule was
-   * rejected, and passing data by semi-global array saves some amount of
-   * allocating and copying
+   * Working state for everything that runs on the main thread
+   * Uses chunkPool and parsePool
    */
-  vector<Chunk*> currentOutput;
+  ParseContext mainContext;
 
   /**
-   * Chunk containing currentInput for output-time rules
+   * Threads used by processGLR() to advance branches in parallel
+   * NULL unless setBranchThreads() has been called with a nonzero value
+   */
+  ThreadPool* branchThreads = NULL;
+
+  /**
+   * One for each worker in branchThreads
    */
-  Chunk* parentChunk;
+  vector<BranchWorker*> branchWorkers;
+
+  /**
+   * Output of checkForReduce() for each branch advanced in parallel
+   * These are concatenated in the order of the branches they came from
+   * so that the result is the same as advancing them one at a time
+   */
+  vector<vector<ParseNode*>> branchResults;
+
+  /**
+   * Number of times processGLR() advanced branches in parallel
+   */
+  unsigned long parallelStepCount = 0;
 
   /**
    * Chunks waiting to be written to output stream
@@ -179,50 +418,176 @@ private:
    */
   vector<ParseNode*> parseGraph;
 
+  /**
+   * Storage for the next value of parseGraph
+   * Kept as a member so that processGLR() doesn't allocate on every token
+   */
+  vector<ParseNode*> nextParseGraph;
+
+  /**
+   * Number of tokens processGLR() has shifted onto parseGraph
+   * and how many of those were shifted onto a single branch
+   */
+  unsigned long stepCount = 0;
+  unsigned long singleBranchStepCount = 0;
+
   /**
    * Pool allocator for Chunks, freed on output flush
    */
-  Pool<Chunk> chunkPool;
+  ChunkPool chunkPool;
 
   /**
    * Pool allocator for ParseNodes, freed on output flush
    */
-  Pool<ParseNode> parsePool;
+  ParseNodePool parsePool;
+
+  /**
+   * Pool allocators for tokens read by readToken()
+   * Tokens in inputBuffer need to outlive the flush that resets chunkPool,
+   * so they are allocated from tokenPool[tokenGen] instead, and when
+   * processGLR() flushes and none of the tokens in inputBuffer came from
+   * the other pool, it resets that pool and reads into it from then on
+   */
+  ChunkPool tokenPool[2];
+
+  /**
+   * Index of the pool in tokenPool that readToken() is allocating from
+   */
+  unsigned int tokenGen = 0;
+
+  /**
+   * Number of tokens at the front of inputBuffer which were allocated from
+   * tokenPool[1-tokenGen]
+   */
+  unsigned int oldGenTokens = 0;
 
   /**
    * The next few tokens in the input stream (usually 5)
    */
-  list<Chunk*> inputBuffer;
+  RingBuffer<Chunk*> inputBuffer;
 
   /**
-   * Pseudo-input buffer used by checkForReduce()
-   * Rules that output a single node are processed immediately
-   * but when rules output multiple nodes, treating them as input
-   * necessitates that reductions could happen, so any output past the first
-   * node is pushed onto currentContinuation, with the next node to be
-   * processed being currentContinuation.back()->back()
+   * The first LU in inputBuffer as of the last call to prepareLookahead()
+   * and the symbols it matches, as given by MatchExe2::prepareSymbols()
+   * Nearly every call to lookahead() checks the same token against
+   * a different branch, so it is only converted once
    */
-  vector<vector<Chunk*>*> currentContinuation;
+  Chunk* lookaheadToken = NULL;
+  vector<int> lookaheadSymbols;
 
   /**
-   * Branch of parseGraph currently being operated on
-   * Needed by applyRule() for FETCHCHUNK and SETCHUNK
+   * The symbols of the token processGLR() is shifting onto every branch
    */
-  ParseNode* currentBranch = nullptr;
+  vector<int> nextSymbols;
 
-  //////////
-  // SETTINGS
-  //////////
+  /**
+   * Results of input-time rules applied since the last flush
+   * rule-1 => input chunks => result
+   * Keys are pointers into the allocators, so this is emptied on every flush
+   */
+  vector<map<vector<Chunk*>, RuleMemo>> ruleMemo;
 
   /**
-   * true if the next input token should be parsed as an LU, false otherwise
+   * Rules which have entries in ruleMemo
    */
-  bool inword = false;
-  
+  vector<int> ruleMemoUsed;
+
+  /**
+   * Whether applyInputRule() should use ruleMemo
+   * Set by processGLR() when there is more than one branch
+   */
+  bool sharingRules = false;
+
+  /**
+   * Number of rule applications answered from ruleMemo
+   */
+  unsigned long sharedRuleCount = 0;
+
+  /**
+   * Cache of the results of reparsing words that didn't get a parse
+   * in context, most recently used first
+   * Each entry maps a key built by reparseKey() to copies of the top-level
+   * nodes that reparsing produced, which are owned by the cache
+   */
+  list<pair<UString, vector<Chunk*>>> reparseCache;
+
+  /**
+   * Index into reparseCache
+   */
+  map<UString, list<pair<UString, vector<Chunk*>>>::iterator> reparseCacheIndex;
+
+  /**
+   * Values of variables and wblank_variables when reparseCache was filled
+   * Input-time rules can read global variables, so if these change,
+   * the cache is emptied
+   */
+  map<UString, UString> reparseCacheVars;
+  map<UString, UString> reparseCacheWblankVars;
+
+  /**
+   * Number of reparses answered from reparseCache and number computed
+   */
+  unsigned long reparseCacheHits = 0;
+  unsigned long reparseCacheMisses = 0;
+
+  /**
+   * Cache of the output of null-flushed segments, most recently used first
+   * The key is the raw text of the segment followed by the values
+   * of variables and wblank_variables before it was processed
+   */
+  list<pair<string, SegmentCacheEntry>> segmentCache;
+
+  /**
+   * Index into segmentCache
+   */
+  map<string, list<pair<string, SegmentCacheEntry>>::iterator> segmentCacheIndex;
+
+  /**
+   * Number of segments answered from segmentCache and number processed
+   */
+  unsigned long segmentCacheHits = 0;
+  unsigned long segmentCacheMisses = 0;
+
+  /**
+   * Segments longer than this (in bytes) are not stored in segmentCache
+   */
+  static const size_t maxCachedSegmentLength = 1 << 16;
+
+  /**
+   * Number of LUs read since the last flush
+   */
+  unsigned int pendingTokens = 0;
+
   /**
-   * true if the next input token should be parsed as a wordbound blank, false otherwise
+   * Number of characters in the LUs read since the last flush
    */
-  bool inwblank = false;
+  size_t pendingChars = 0;
+
+  /**
+   * When the first LU since the last flush was read
+   * Only updated if maxPendingMillis is set
+   */
+  chrono::steady_clock::time_point pendingSince;
+
+  /**
+   * Number of times processGLR() has output a parse
+   * and how many of those were forced by maxPendingTokens, maxPendingMillis,
+   * or memoryBudget, and how many by memoryBudget in particular
+   */
+  unsigned long flushCount = 0;
+  unsigned long forcedFlushCount = 0;
+  unsigned long budgetFlushCount = 0;
+
+  /**
+   * Largest pendingMemory() seen at a flush, and the number of times
+   * processTRX() has moved its queues into fresh pools
+   */
+  size_t peakPendingMemory = 0;
+  unsigned long compactionCount = 0;
+
+  //////////
+  // SETTINGS
+  //////////
 
   /**
    * Whether output should flush on \0
@@ -284,7 +649,7 @@ private:
    * Counter used to give distinct, consistent identifiers to ParseNodes
    * for tracing purposes
    */
-  int newBranchId = 0;
+  atomic<int> newBranchId;
 
   /**
    * If this is set to true, filterParseGraph() will only discard branches
@@ -292,6 +657,83 @@ private:
    */
   bool noFilter = true;
 
+  /**
+   * Maximum number of entries in reparseCache, 0 disables it
+   */
+  unsigned int reparseCacheSize = 1024;
+
+  /**
+   * If nonzero, processGLR() will output the best available parse
+   * once this many LUs are pending, regardless of whether it could continue
+   */
+  unsigned int maxPendingTokens = 0;
+
+  /**
+   * If nonzero, processGLR() will output the best available parse
+   * if it has been this many milliseconds since the first pending LU was read
+   * This is checked as each token is read, so it does not help
+   * if the input stream itself stalls
+   */
+  unsigned int maxPendingMillis = 0;
+
+  /**
+   * If nonzero, processGLR() will output the best available parse
+   * once pendingMemory() exceeds this many bytes, so that pathological
+   * input can't make the parse graph grow without limit
+   */
+  size_t memoryBudget = 0;
+
+  /**
+   * If true, process() makes sure memory use doesn't grow with the input
+   * by applying defaultMemoryBudget and a limit on retained buckets
+   * when they haven't been set
+   */
+  bool constantMemory = false;
+  static const size_t defaultMemoryBudget = 64 << 20;
+
+  /**
+   * How many chunks processTRX() allocates before moving the chunks
+   * it still needs into the spare token pool and resetting the others
+   */
+  static const unsigned int compactionInterval = 4096;
+
+  /**
+   * Maximum number of entries in segmentCache, 0 disables it
+   * The cache is only used in null flush mode
+   */
+  unsigned int segmentCacheSize = 0;
+
+  /**
+   * If true, print statistics to cerr when processing finishes
+   */
+  bool printingStats = false;
+
+  /**
+   * Number of buckets each allocator keeps between sentences, 0 for no limit
+   */
+  unsigned int poolRetainBuckets = 32;
+
+  /**
+   * Whether allocators should use huge pages
+   */
+  bool poolHugePages = false;
+
+  /**
+   * If true, process() reads and tokenizes the input on a separate thread
+   */
+  bool pipelined = false;
+
+  /**
+   * If true, processTRX() runs each rule layer on its own thread
+   */
+  bool layerThreads = false;
+
+  /**
+   * Minimum number of branches for processGLR() to advance them
+   * on branchThreads rather than one at a time
+   */
+  unsigned int branchThreshold = 16;
+
   //////////
   // VIRTUAL MACHINE
   //////////
@@ -308,82 +750,100 @@ private:
 
   /**
    * The virtual machine
-   * Modifies: theStack, stackIdx, variables, currentOutput
-   * Reads from: currentInput, parentChunk
+   * Modifies: ctx.theStack, ctx.stackIdx, ctx.currentOutput
+   * Reads from: ctx.currentInput, ctx.parentChunk
+   * Safe to call on several threads at once with different contexts
    * @param rule - bytecode for rule to be applied
    * @return false if REJECTRULE was executed, true otherwise
    */
-  bool applyRule(const UString& rule);
+  bool applyRule(ParseContext& ctx, const UString& rule);
 
   /**
-   * Pop and return a boolean from theStack
-   * Log error and call exit(1) if top element is not a bool
+   * Apply input-time rule to ctx.currentInput
+   * If sharingRules is set and another branch has already applied it
+   * to the same chunks, reuse the result and repeat its variable writes
+   * @return false if the rule was rejected, true otherwise
    */
-  bool popBool();
+  bool applyInputRule(ParseContext& ctx, int rule);
 
   /**
-   * Pop and return an integer from theStack
-   * Log error and call exit(1) if top element is not an int
+   * Fill dest with src, replacing the chunks that aren't in input with
+   * copies from ctx.chunkPool so that rules which modify the chunks they
+   * are given (SETRULE, SETCLIP, APPENDSURFACE) can't affect other branches
+   * Only the top level is copied, since rules only modify their inputs
    */
-  int popInt();
+  void copyMemoOutput(ParseContext& ctx, const vector<Chunk*>& src,
+                      const vector<Chunk*>& input, vector<Chunk*>& dest);
 
   /**
-   * Pop and return a UString from theStack
-   * Log error and call exit(1) if top element is not a UString
+   * Copy ch into ctx.chunkPool with ctx.out_wblank as its wordbound blank,
+   * for OUTPUT and APPENDCHILD, which mustn't modify chunks that other
+   * branches may be reading
    */
-  UString popString();
+  Chunk* copyWithWblank(ParseContext& ctx, Chunk* ch);
 
   /**
-   * Equivalent to popString(), but with called as
-   * UString x; popString(x);
-   * rather than
-   * UString x = popString();
-   * This uses a swap to save an allocation and a copy, which is almost twice
-   * as fast, which has a noticeable impact on overall speed
+   * Empty ruleMemo
    */
-  void popString(UString& dest);
+  void clearRuleMemo();
+
+  //////////
+  // RULE SELECTION AND I/O
+  //////////
 
   /**
-   * Pop and return a Chunk pointer from theStack
-   * Log error and call exit(1) if top element is not a Chunk*
+   * The input stream
    */
-  Chunk* popChunk();
+  TokenReader infile;
 
-  inline void pushStack(bool b)
-  {
-    theStack[++stackIdx].mode = 0;
-    theStack[stackIdx].b = b;
-    theWblankStack[stackIdx].clear();
-  }
-  inline void pushStack(int i)
-  {
-    theStack[++stackIdx].mode = 1;
-    theStack[stackIdx].i = i;
-    theWblankStack[stackIdx].clear();
-  }
-  inline void pushStack(const UString& s, UString wbl = ""_u)
-  {
-    theStack[++stackIdx].mode = 2;
-    theStack[stackIdx].s.assign(s);
-    theWblankStack[stackIdx] = wbl;
-  }
-  inline void pushStack(Chunk* c)
-  {
-    theStack[++stackIdx].mode = 3;
-    theStack[stackIdx].c = c;
-    theWblankStack[stackIdx].clear();
-  }
+  /**
+   * With segmentCache, splits the input into segments for processUnit(),
+   * which reads each of them through infile
+   */
+  TokenReader segmentReader;
 
   /**
-   * Copy the contents of theStack[src] to theStack[dest]
+   * The last token read, kept so that its storage is reused
    */
-  void stackCopy(int src, int dest);
+  Token token;
 
-  //////////
-  // RULE SELECTION AND I/O
-  //////////
+  /**
+   * When pipelining, tokens are read from infile on tokenThread and
+   * passed through tokenQueue, and inputEnded records whether the one
+   * marked last has been taken from it
+   */
+  SpscQueue<QueuedToken>* tokenQueue = NULL;
+  thread* tokenThread = NULL;
+  bool inputEnded = false;
+  static const unsigned int tokenQueueSize = 1024;
+
+  /**
+   * Number of times the parser waited for tokenThread and vice versa
+   */
+  unsigned long tokenQueueEmptyWaits = 0;
+  unsigned long tokenQueueFullWaits = 0;
+
+  /**
+   * Body of tokenThread
+   */
+  void readTokens();
 
-  InputFile infile;
+  /**
+   * Start and stop tokenThread
+   * stopTokenThread() must only be called once the last token has been taken
+   */
+  void startTokenThread();
+  void stopTokenThread();
+
+  /**
+   * Get the next token from tokenQueue if it is running, otherwise from infile
+   */
+  TokenKind nextToken();
+
+  /**
+   * Whether the whole input has been read
+   */
+  bool atEnd();
 
   /**
    * Read an LU or a blank
@@ -393,7 +853,19 @@ private:
    */
   Chunk* readToken();
 
-  bool lookahead(ParseNode* node);
+  /**
+   * Check whether node could shift the next non-blank token, which is
+   * taken from the continuation cont starting at pos if there is one
+   * and from inputBuffer otherwise
+   */
+  bool lookahead(ParseContext& ctx, ParseNode* node, int cont = -1, int pos = 0);
+
+  /**
+   * Update lookaheadToken and lookaheadSymbols if the first LU
+   * in inputBuffer has changed
+   * Must be called on the main thread before lookahead() is used
+   */
+  void prepareLookahead();
 
   /**
    * Check whether any rules can apply to node
@@ -401,42 +873,208 @@ private:
    * if not or there is a shift-reduce conflict, fork
    * append resulting node(s) to result
    */
-  void checkForReduce(vector<ParseNode*>& result, ParseNode* node);
+  void checkForReduce(ParseContext& ctx, vector<ParseNode*>& result, ParseNode* node);
+
+  /**
+   * Hand a node on which no further reductions are possible back to
+   * checkForReduce(), either by shifting the next chunk of continuation
+   * cont onto it or, if there are none left, by appending it to result
+   */
+  void continueReduce(ParseContext& ctx, vector<ParseNode*>& result, ParseNode* node, int cont, int pos);
+
+  /**
+   * Shift next onto branch and append the results of checkForReduce() to result
+   * nextSymbols must have been prepared from next
+   */
+  void advanceBranch(ParseContext& ctx, ParseNode* branch, Chunk* next, vector<ParseNode*>& result);
+
+  /**
+   * Free the allocators of mainContext and of branchWorkers
+   */
+  void resetPools();
+
+  /**
+   * Apply poolRetainBuckets and poolHugePages to every allocator
+   */
+  void configurePools();
+
+  /**
+   * Reparse ch disregarding context and fill dest (which should be empty)
+   * with the resulting top-level nodes, using reparseCache if possible
+   */
+  void reparseChunk(Chunk* ch, list<Chunk*>& dest);
+
+  /**
+   * Append a serialization of ch and its descendants to key
+   */
+  void reparseKey(Chunk* ch, UString& key);
+
+  /**
+   * Copy ch and its descendants, allocating from chunkPool if pooled
+   * is true and from the heap otherwise
+   */
+  Chunk* copyTree(Chunk* ch, bool pooled);
+
+  /**
+   * Copy ch and its descendants into dest for compactTRX()
+   * Strings are moved rather than copied, since ch is about to be freed,
+   * and chunks reached more than once are only copied once
+   */
+  Chunk* relocateTree(Chunk* ch, ChunkPool& dest, unordered_map<Chunk*, Chunk*>& moved);
+
+  /**
+   * Move the chunks in queues into the spare token pool
+   * and reset the pools they came from
+   * Only valid between layers, when nothing else refers to any chunks
+   */
+  void compactTRX(const vector<list<Chunk*>*>& queues);
+
+  /**
+   * Delete a tree created by copyTree(ch, false)
+   */
+  void deleteTree(Chunk* ch);
+
+  /**
+   * Empty reparseCache
+   */
+  void clearReparseCache();
 
   /**
    * Output the next blank in blankQueue, or a space if the queue is empty
    */
-  void writeBlank(UFILE* out);
+  void writeBlank(OutputWriter* out);
 
   /**
    * Apply output-time rules and write nodes to output stream
    * @param out - output stream
    */
-  void outputAll(UFILE* out);
+  void outputAll(OutputWriter* out);
 
   /**
    * Prune any ParseNodes that have reached error states
    * Modifies: parseGraph
+   * @param force - select a single branch for output even if
+   * some could accept further input
    * @return true if outputAll should be called
    */
-  bool filterParseGraph();
+  bool filterParseGraph(bool force = false);
+
+  /**
+   * Check whether maxPendingTokens, maxPendingMillis,
+   * or memoryBudget has been exceeded
+   */
+  bool shouldForceFlush();
+
+  /**
+   * Estimate the memory used by the sentence being parsed
+   * This counts the allocator slots in use and the text of the input,
+   * but not strings built by rules
+   */
+  size_t pendingMemory();
 
   /**
    * Process input as a GLR parser
    * Read input, call checkForReduce(), call filterParseGraph(), call outputAll()
    */
-  void processGLR(UFILE* out);
+  void processGLR(OutputWriter* out);
 
   /**
    * Apply longest rule matching the beginning of t1x and append the result to t2x
+   * @param moreInput - whether more chunks may be appended to t1x,
+   * in which case nothing is done until it holds a full pattern
+   * @param outputWaiting - whether chunks already taken from t2x
+   * are still waiting to be matched by the next layer
    */
-  void processTRXLayer(list<Chunk*>& t1x, list<Chunk*>& t2x);
+  void processTRXLayer(ParseContext& ctx, list<Chunk*>& t1x, list<Chunk*>& t2x,
+                       bool moreInput, bool outputWaiting = false);
+
+  /**
+   * Apply output-time rules to the chunks in t3x and write the results
+   */
+  void outputTRX(list<Chunk*>& t3x, OutputWriter* out);
 
   /**
    * Mimic apertium-transfer | apertium-interchunk | apertium-postchunk
    * Read input, call processTRXLayer twice, apply output-time rules, output
    */
-  void processTRX(UFILE* out);
+  void processTRX(OutputWriter* out);
+
+  /**
+   * The layers of processTRX() when layerThreads is set
+   * Tokens are read and the first layer applied on one thread,
+   * the second layer on another, and output rules on the calling thread,
+   * with layerQueues between them
+   */
+  TRXLayer trxLayers[2];
+  SpscQueue<LayerItem>* layerQueues[2] = {NULL, NULL};
+  static const unsigned int layerQueueSize = 256;
+
+  /**
+   * Incremented by the output thread each time it has compacted
+   * the pools for the layers waiting on compactDone
+   */
+  unsigned long compactGeneration = 0;
+  mutex compactLock;
+  condition_variable compactDone;
+
+  /**
+   * Steps taken by the second layer and the chunks they consumed,
+   * from which the first layer can tell whether processTRX()
+   * would have anything left in t2x
+   */
+  unsigned long layerStepsDone = 0;
+  size_t layerChunksConsumed = 0;
+  mutex layerStepLock;
+  condition_variable layerStepDone;
+
+  /**
+   * Number of times a stage waited for the one before it
+   * and for the one after it
+   */
+  unsigned long layerQueueEmptyWaits = 0;
+  unsigned long layerQueueFullWaits = 0;
+
+  void processTRXLayered(OutputWriter* out);
+
+  /**
+   * Bodies of the threads for the first and second layers
+   */
+  void runFirstLayer();
+  void runSecondLayer();
+
+  /**
+   * Pass produced on to next
+   */
+  void sendLayerOutput(list<Chunk*>& produced, SpscQueue<LayerItem>* next);
+
+  /**
+   * Send LayerCompact to next and wait until the output thread
+   * has compacted the pools
+   */
+  void requestCompaction(SpscQueue<LayerItem>* next);
+
+  /**
+   * Process one null-flushed segment from infile
+   * and reset the allocators afterwards
+   */
+  void processSegment(OutputWriter* out);
+
+  /**
+   * Drop whatever a segment that ended in an error left behind,
+   * so that the next one starts afresh
+   */
+  void discardSegment();
+
+  /**
+   * Null flush mode, but with each segment read from in ahead of time so
+   * that repeated segments can be answered from segmentCache
+   */
+  void processCachedSegments(FILE* in, OutputWriter* out);
+
+  /**
+   * With constantMemory, fill in the settings it implies
+   */
+  void applyConstantMemory();
   
   /**
    * True if clipping lem/lemh/whole
@@ -447,10 +1085,49 @@ public:
   RTXProcessor();
   ~RTXProcessor();
 
+  /**
+   * Load a grammar for this processor alone
+   * Exits with a message on stderr if it can't be read
+   */
   void read(string const &filename);
-  void process(FILE *in, UFILE *out);
+
+  /**
+   * Use a grammar which has already been loaded, such as one shared
+   * with processors on other threads
+   * This also resets global variables
+   */
+  void setGrammar(shared_ptr<const CompiledGrammar> g);
+  void process(FILE *in, OutputWriter* out);
+
+  /**
+   * Process a piece of input that has already been read in full,
+   * such as one null-flushed segment including its \0
+   * Throws std::runtime_error if the input or grammar is malformed,
+   * after which the processor can go on to the next unit
+   * @param output - the output is written here as UTF-8
+   */
+  void processUnit(const string& input, string& output);
+  void processUnit(const string& input, OutputWriter* out);
+
+  /**
+   * Set global variables back to their initial values, so that
+   * the next unit doesn't depend on the ones before it
+   */
+  void resetVariables();
+
+  /**
+   * Write cache and flush statistics to cerr
+   */
+  void printStatistics();
   bool getNullFlush(void);
   void setNullFlush(bool null_flush);
+  /**
+   * Read input in the binary stream format rather than as text
+   */
+  void setBinaryInput(bool val)
+  {
+    infile.setBinary(val);
+  }
   void printSteps(bool val)
   {
     printingSteps = val;
@@ -488,6 +1165,57 @@ public:
     noFilter = val;
   }
   bool setOutputMode(string mode);
+  void setReparseCacheSize(unsigned int val)
+  {
+    reparseCacheSize = val;
+  }
+  void setMaxPendingTokens(unsigned int val)
+  {
+    maxPendingTokens = val;
+  }
+  void setMaxPendingMillis(unsigned int val)
+  {
+    maxPendingMillis = val;
+  }
+  void setMemoryBudget(size_t val)
+  {
+    memoryBudget = val;
+  }
+  void setConstantMemory(bool val)
+  {
+    constantMemory = val;
+  }
+  void setSegmentCacheSize(unsigned int val)
+  {
+    segmentCacheSize = val;
+  }
+  void printStats(bool val)
+  {
+    printingStats = val;
+  }
+  void setBranchThreads(unsigned int val);
+  void setBranchThreshold(unsigned int val)
+  {
+    branchThreshold = val;
+  }
+  void setPoolRetainBuckets(unsigned int val)
+  {
+    poolRetainBuckets = val;
+    configurePools();
+  }
+  void setPipelined(bool val)
+  {
+    pipelined = val;
+  }
+  void setLayerThreads(bool val)
+  {
+    layerThreads = val;
+  }
+  void setPoolHugePages(bool val)
+  {
+    poolHugePages = val;
+    configurePools();
+  }
 };
 
 #endif
@@ -0,0 +1,315 @@
+#include <rtx_config.h>
+#include <rtx_server.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void
+requestStop(int)
+{
+  stopRequested = 1;
+}
+
+RTXServer::RTXServer(const vector<RTXProcessor*>& procs)
+: workers(procs)
+{}
+
+bool
+RTXServer::readFull(int fd, char* data, size_t n)
+{
+  while(n > 0)
+  {
+    ssize_t got = read(fd, data, n);
+    if(got < 0 && errno == EINTR) continue;
+    if(got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      cerr << "Closing connection which stopped part way through a request." << endl;
+    }
+    if(got <= 0) return false;
+    data += got;
+    n -= got;
+  }
+  return true;
+}
+
+bool
+RTXServer::writeFull(int fd, const char* data, size_t n)
+{
+  while(n > 0)
+  {
+    ssize_t put = write(fd, data, n);
+    if(put < 0 && errno == EINTR) continue;
+    if(put < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      cerr << "Closing connection which stopped reading its response." << endl;
+    }
+    if(put <= 0) return false;
+    data += put;
+    n -= put;
+  }
+  return true;
+}
+
+bool
+RTXServer::serveRequest(RTXProcessor* proc, int fd, string& input, string& output)
+{
+  unsigned char header[4];
+  if(!readFull(fd, (char*)header, 4))
+  {
+    return false;
+  }
+  size_t length = ((size_t)header[0] << 24) | (header[1] << 16) |
+                  (header[2] << 8) | header[3];
+  if(length > MaxRequestLength)
+  {
+    cerr << "Closing connection after a request of " << length << " bytes." << endl;
+    return false;
+  }
+  input.resize(length);
+  if(!readFull(fd, &input[0], length))
+  {
+    return false;
+  }
+  auto start = chrono::steady_clock::now();
+
+  output.clear();
+  if(length > 0)
+  {
+    proc->resetVariables();
+    try
+    {
+      proc->processUnit(input, output);
+    }
+    catch(const runtime_error& e)
+    {
+      // the protocol has no way to report an error,
+      // so the client sees the connection close instead
+      cerr << "Closing connection after an error: " << e.what() << endl;
+      return false;
+    }
+  }
+  size_t outLength = output.size();
+  header[0] = outLength >> 24;
+  header[1] = outLength >> 16;
+  header[2] = outLength >> 8;
+  header[3] = outLength;
+  if(!writeFull(fd, (const char*)header, 4) ||
+     !writeFull(fd, output.data(), outLength))
+  {
+    return false;
+  }
+
+  double latency = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+  lock_guard<mutex> guard(lock);
+  requestCount++;
+  bytesIn += length;
+  bytesOut += outLength;
+  totalLatency += latency;
+  if(latency > maxLatency)
+  {
+    maxLatency = latency;
+  }
+  if(printingStats)
+  {
+    cerr << "Request " << requestCount << ": " << length << " bytes in, "
+         << outLength << " bytes out, " << latency << "ms" << endl;
+  }
+  return true;
+}
+
+void
+RTXServer::work(RTXProcessor* proc)
+{
+  string input;
+  string output;
+  while(true)
+  {
+    int fd;
+    {
+      unique_lock<mutex> guard(lock);
+      connectionReady.wait(guard, [&]{ return finished || !waiting.empty(); });
+      if(waiting.empty())
+      {
+        return;
+      }
+      fd = waiting.front();
+      waiting.pop_front();
+      active.insert(fd);
+    }
+    bool open = serveRequest(proc, fd, input, output);
+    {
+      lock_guard<mutex> guard(lock);
+      active.erase(fd);
+      if(open && !finished)
+      {
+        idle.insert(fd);
+        char c = 0;
+        while(write(wakeFds[1], &c, 1) < 0 && errno == EINTR);
+        continue;
+      }
+    }
+    close(fd);
+  }
+}
+
+void
+RTXServer::serve(const string& path)
+{
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path))
+  {
+    cerr << "Socket path " << path << " is too long." << endl;
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, path.c_str());
+
+  // a socket left behind by a server that didn't exit cleanly
+  struct stat info;
+  if(lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+  {
+    unlink(path.c_str());
+  }
+
+  listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listenFd < 0 ||
+     bind(listenFd, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+     listen(listenFd, 64) < 0)
+  {
+    cerr << "Unable to listen on " << path << ": " << strerror(errno) << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if(pipe(wakeFds) < 0)
+  {
+    cerr << "Unable to create a pipe: " << strerror(errno) << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, requestStop);
+  signal(SIGTERM, requestStop);
+
+  vector<thread> threads;
+  for(auto proc : workers)
+  {
+    threads.push_back(thread(&RTXServer::work, this, proc));
+  }
+  auto started = chrono::steady_clock::now();
+
+  // the listening socket, the wakeup pipe, then each idle connection
+  vector<pollfd> pfds;
+  while(!stopRequested)
+  {
+    pfds.resize(2);
+    pfds[0].fd = listenFd;
+    pfds[1].fd = wakeFds[0];
+    {
+      lock_guard<mutex> guard(lock);
+      for(auto fd : idle)
+      {
+        pfds.push_back(pollfd());
+        pfds.back().fd = fd;
+      }
+    }
+    for(auto& pfd : pfds)
+    {
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+    }
+    // wake up regularly to notice signals
+    if(poll(pfds.data(), pfds.size(), 250) <= 0)
+    {
+      continue;
+    }
+    if(pfds[1].revents)
+    {
+      char buf[64];
+      while(read(wakeFds[0], buf, sizeof(buf)) < 0 && errno == EINTR);
+    }
+    lock_guard<mutex> guard(lock);
+    for(unsigned int i = 2; i < pfds.size(); i++)
+    {
+      // a request, or the client closing the connection,
+      // both of which are for a worker to deal with
+      if(pfds[i].revents)
+      {
+        idle.erase(pfds[i].fd);
+        waiting.push_back(pfds[i].fd);
+        connectionReady.notify_one();
+      }
+    }
+    if(pfds[0].revents)
+    {
+      int fd = accept(listenFd, NULL, NULL);
+      if(fd >= 0)
+      {
+        timeval timeout = {IoTimeoutSeconds, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        connectionCount++;
+        idle.insert(fd);
+      }
+    }
+  }
+
+  close(listenFd);
+  unlink(path.c_str());
+  {
+    lock_guard<mutex> guard(lock);
+    finished = true;
+    for(auto fd : waiting)
+    {
+      close(fd);
+    }
+    waiting.clear();
+    for(auto fd : idle)
+    {
+      close(fd);
+    }
+    idle.clear();
+    // workers are blocked reading the next request,
+    // which this makes them give up on
+    for(auto fd : active)
+    {
+      shutdown(fd, SHUT_RDWR);
+    }
+  }
+  connectionReady.notify_all();
+  for(auto& t : threads)
+  {
+    t.join();
+  }
+  close(wakeFds[0]);
+  close(wakeFds[1]);
+
+  if(printingStats)
+  {
+    double uptime = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+    cerr << "Requests: " << requestCount << " on " << connectionCount << " connections" << endl;
+    if(requestCount > 0)
+    {
+      cerr << "Latency: " << (totalLatency / requestCount) << "ms mean, "
+           << maxLatency << "ms max" << endl;
+    }
+    if(uptime > 0)
+    {
+      cerr << "Throughput: " << (requestCount / uptime) << " requests/s, "
+           << (bytesIn / uptime / 1024) << "KB/s in, "
+           << (bytesOut / uptime / 1024) << "KB/s out over " << uptime << "s" << endl;
+    }
+  }
+}
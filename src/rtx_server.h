@@ -0,0 +1,116 @@
+#ifndef __RTXSERVER__
+#define __RTXSERVER__
+
+#include <rtx_config.h>
+#include <rtx_processor.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Serves requests over a Unix domain socket with a grammar loaded once
+ * Each request and each response is a 4-byte big-endian length followed
+ * by that many bytes of UTF-8, and a connection can send any number of
+ * requests one after another
+ * Each request is processed as a complete input, starting from the
+ * initial values of global variables
+ * The thread that accepts connections also waits for requests on them,
+ * and each request is handed to one of a fixed set of worker threads,
+ * each with its own RTXProcessor, which hands the connection back once
+ * it has answered, so idle connections don't keep workers busy
+ */
+class RTXServer
+{
+private:
+  /**
+   * Requests longer than this close the connection rather than
+   * being read into memory
+   */
+  static const size_t MaxRequestLength = 1 << 28;
+
+  /**
+   * A worker only gets a connection once part of a request has arrived,
+   * and gives up on it if reading the rest or writing the response
+   * makes no progress for this long, so that clients which stop
+   * part way through can't hold on to workers
+   */
+  static const int IoTimeoutSeconds = 10;
+
+  vector<RTXProcessor*> workers;
+  bool printingStats = false;
+
+  int listenFd = -1;
+
+  /**
+   * Connections waiting for their next request, connections with a
+   * request waiting for a worker, and the connections currently being
+   * served, which are shut down when the server stops
+   */
+  set<int> idle;
+  deque<int> waiting;
+  set<int> active;
+  bool finished = false;
+  mutex lock;
+  condition_variable connectionReady;
+
+  /**
+   * Written to by workers when they add to idle,
+   * so that serve() starts waiting on the connection again
+   */
+  int wakeFds[2] = {-1, -1};
+
+  /**
+   * Statistics, protected by lock
+   */
+  unsigned long connectionCount = 0;
+  unsigned long requestCount = 0;
+  unsigned long long bytesIn = 0;
+  unsigned long long bytesOut = 0;
+  double totalLatency = 0.0;
+  double maxLatency = 0.0;
+
+  /**
+   * Read or write exactly n bytes
+   * @return false if the connection closed or failed first
+   */
+  static bool readFull(int fd, char* data, size_t n);
+  static bool writeFull(int fd, const char* data, size_t n);
+
+  /**
+   * Answer one request on fd
+   * @return false if the connection closed or failed,
+   * or the request couldn't be processed
+   */
+  bool serveRequest(RTXProcessor* proc, int fd, string& input, string& output);
+
+  /**
+   * Body of each worker thread
+   */
+  void work(RTXProcessor* proc);
+public:
+  /**
+   * @param procs - one configured processor per worker thread,
+   * which must outlive this object
+   */
+  RTXServer(const vector<RTXProcessor*>& procs);
+
+  /**
+   * Listen on path until SIGINT or SIGTERM
+   * An existing socket at path is replaced, and removed on exit
+   */
+  void serve(const string& path);
+  void printStats(bool val)
+  {
+    printingStats = val;
+  }
+};
+
+#endif
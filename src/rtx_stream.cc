@@ -0,0 +1,52 @@
+#include <rtx_config.h>
+#include <token_reader.h>
+#include <output_writer.h>
+#include <lttoolbox/cli.h>
+#include <lttoolbox/file_utils.h>
+#include <lttoolbox/lt_locale.h>
+#include <iostream>
+
+int main(int argc, char *argv[])
+{
+  LtLocale::tryToSetLocale();
+  CLI cli("convert a stream between text and the binary format of rtx-proc -i and -o", PACKAGE_VERSION);
+  cli.add_bool_arg('d', "decode", "convert binary to text rather than text to binary");
+  cli.add_bool_arg('h', "help", "print this message and exit");
+  cli.add_file_arg("input_file", true);
+  cli.add_file_arg("output_file", true);
+  cli.parse_args(argc, argv);
+
+  bool decode = cli.get_bools()["decode"];
+  FILE* input = openInBinFile(cli.get_files()[0]);
+  FILE* output = openOutBinFile(cli.get_files()[1]);
+
+  {
+    TokenReader reader;
+    reader.setBinary(decode);
+    reader.setNullFlush(true);
+    reader.wrap(input);
+    OutputWriter writer(output);
+    writer.setBinary(!decode);
+    Token tok;
+    while(true)
+    {
+      TokenKind kind = reader.next(tok);
+      if(kind == TokenWord)
+      {
+        writer.writeWord(tok.wblank, tok.source, tok.target, tok.coref);
+        continue;
+      }
+      writer.write(tok.blank);
+      if(kind == TokenEnd)
+      {
+        if(reader.eof()) break;
+        writer.endSegment();
+      }
+    }
+    writer.flush();
+  }
+
+  fclose(input);
+  fclose(output);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+#ifndef __RTXSPSCQUEUE__
+#define __RTXSPSCQUEUE__
+
+#include <rtx_config.h>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Bounded queue between exactly one producer thread and one consumer thread
+ * Pushing and popping only touch the two indices, and a side that finds
+ * the queue full or empty spins briefly before sleeping, so the mutex
+ * is only used when one of the threads has actually run out of work
+ * Slots are reused rather than destroyed, so a producer that fills
+ * the slot from startPush() in place, for instance by swapping strings
+ * into it, recycles the storage the consumer left there
+ */
+template<typename T>
+class SpscQueue
+{
+private:
+  static const unsigned int SpinCount = 256;
+  std::vector<T> slots;
+  size_t mask;
+  alignas(64) std::atomic<size_t> head;
+  alignas(64) std::atomic<size_t> tail;
+  alignas(64) std::atomic<bool> producerWaiting;
+  std::atomic<bool> consumerWaiting;
+  std::mutex lock;
+  std::condition_variable wake;
+
+  /**
+   * Number of times each side had to sleep
+   */
+  unsigned long producerWaitCount = 0;
+  unsigned long consumerWaitCount = 0;
+
+  bool full() const
+  {
+    return tail.load() - head.load() == slots.size();
+  }
+  bool empty() const
+  {
+    return tail.load() == head.load();
+  }
+  /**
+   * Wait until done() returns true
+   * The flag is set before done() is checked again, and the other side
+   * checks the flag after moving its index, so one of them always
+   * sees the other
+   */
+  template<typename F>
+  void waitFor(std::atomic<bool>& waiting, unsigned long& count, F done)
+  {
+    for(unsigned int i = 0; i < SpinCount; i++)
+    {
+      if(done()) return;
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    waiting = true;
+    if(!done())
+    {
+      count++;
+      wake.wait(guard, done);
+    }
+    waiting = false;
+  }
+  void notify(std::atomic<bool>& waiting)
+  {
+    if(waiting.load())
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      wake.notify_all();
+    }
+  }
+public:
+  /**
+   * @param capacity - rounded up to a power of 2
+   */
+  SpscQueue(size_t capacity)
+  : head(0), tail(0), producerWaiting(false), consumerWaiting(false)
+  {
+    size_t size = 1;
+    while(size < capacity)
+    {
+      size *= 2;
+    }
+    slots.resize(size);
+    mask = size - 1;
+  }
+  /**
+   * Producer: wait for a free slot and return it
+   * It becomes visible to the consumer on finishPush()
+   */
+  T& startPush()
+  {
+    if(full())
+    {
+      waitFor(producerWaiting, producerWaitCount, [&]{ return !full(); });
+    }
+    return slots[tail.load() & mask];
+  }
+  void finishPush()
+  {
+    tail.store(tail.load() + 1);
+    notify(consumerWaiting);
+  }
+  /**
+   * Consumer: wait for the oldest item and return it
+   * It stays in the queue until pop()
+   */
+  T& front()
+  {
+    if(empty())
+    {
+      waitFor(consumerWaiting, consumerWaitCount, [&]{ return !empty(); });
+    }
+    return slots[head.load() & mask];
+  }
+  void pop()
+  {
+    head.store(head.load() + 1);
+    notify(producerWaiting);
+  }
+  unsigned long producerWaits() const
+  {
+    return producerWaitCount;
+  }
+  unsigned long consumerWaits() const
+  {
+    return consumerWaitCount;
+  }
+};
+
+#endif
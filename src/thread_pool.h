@@ -0,0 +1,137 @@
+#ifndef __RTXTHREADPOOL__
+#define __RTXTHREADPOOL__
+
+#include <rtx_config.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A fixed set of threads for running parallel loops
+ * The threads are started once and wait between calls to run(),
+ * since the loops are too short to be worth starting threads for
+ */
+class ThreadPool
+{
+private:
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable wake;
+  std::condition_variable done;
+  const std::function<void(unsigned int, unsigned int)>* job = nullptr;
+  unsigned int jobSize = 0;
+  std::atomic<unsigned int> nextItem;
+  unsigned int busy = 0;
+  unsigned long generation = 0;
+  bool stopping = false;
+
+  /**
+   * The first exception thrown by the current job, rethrown by run()
+   */
+  std::exception_ptr error;
+
+  void work(unsigned int worker)
+  {
+    unsigned int item;
+    while((item = nextItem++) < jobSize)
+    {
+      try
+      {
+        (*job)(worker, item);
+      }
+      catch(...)
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if(!error) error = std::current_exception();
+        // nobody will look at the results of the other items
+        nextItem = jobSize;
+      }
+    }
+  }
+  void loop(unsigned int worker)
+  {
+    unsigned long seen = 0;
+    while(true)
+    {
+      {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [&]{ return stopping || generation != seen; });
+        if(stopping) return;
+        seen = generation;
+      }
+      work(worker);
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if(--busy == 0) done.notify_all();
+      }
+    }
+  }
+public:
+  /**
+   * Start count threads
+   * The thread calling run() also takes part, so loops are run
+   * by count+1 workers in total
+   */
+  ThreadPool(unsigned int count)
+  : nextItem(0)
+  {
+    for(unsigned int i = 0; i < count; i++)
+    {
+      threads.push_back(std::thread(&ThreadPool::loop, this, i));
+    }
+  }
+  ~ThreadPool()
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for(auto& t : threads)
+    {
+      t.join();
+    }
+  }
+  /**
+   * Number of workers available to run(), including the calling thread
+   */
+  unsigned int size() const
+  {
+    return threads.size() + 1;
+  }
+  /**
+   * Call fn(worker, item) for every item in [0, count) and wait for
+   * all of them to finish
+   * worker is in [0, size()) and no two concurrent calls share it,
+   * but the order in which items are processed is unspecified
+   * If any call throws, the remaining items are skipped and
+   * the first exception is rethrown once every worker has stopped
+   */
+  void run(unsigned int count, const std::function<void(unsigned int, unsigned int)>& fn)
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      job = &fn;
+      jobSize = count;
+      nextItem = 0;
+      busy = threads.size();
+      generation++;
+    }
+    wake.notify_all();
+    work(threads.size());
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&]{ return busy == 0; });
+    if(error)
+    {
+      std::exception_ptr e = error;
+      error = nullptr;
+      std::rethrow_exception(e);
+    }
+  }
+};
+
+#endif
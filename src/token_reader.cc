@@ -0,0 +1,409 @@
+#include <rtx_config.h>
+#include <token_reader.h>
+#include <unicode/utf8.h>
+#include <unicode/utf16.h>
+
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+static void
+appendUtf8(const string& s, UString& dest)
+{
+  int32_t len = s.size();
+  for(int32_t i = 0; i < len;)
+  {
+    if((unsigned char)s[i] < 0x80)
+    {
+      dest += (UChar)s[i++];
+      continue;
+    }
+    UChar32 c;
+    U8_NEXT(s.data(), i, len, c);
+    if(c < 0)
+    {
+      c = 0xFFFD;
+    }
+    if(c <= 0xFFFF)
+    {
+      dest += (UChar)c;
+    }
+    else
+    {
+      dest += (UChar)U16_LEAD(c);
+      dest += (UChar)U16_TRAIL(c);
+    }
+  }
+}
+
+TokenReader::TokenReader()
+: infile("^$/[]\\"), binary(false), nullFlush(false), inword(false),
+  inwblank(false), checkedMagic(false), havePendingWord(false)
+{}
+
+void
+TokenReader::wrap(FILE* in)
+{
+  infile.wrap(in);
+  // a unit that ended in the middle of an LU shouldn't affect the next one
+  inword = false;
+  inwblank = false;
+}
+
+bool
+TokenReader::eof()
+{
+  return infile.eof() && !havePendingWord;
+}
+
+void
+TokenReader::setBinary(bool val)
+{
+  binary = val;
+}
+
+bool
+TokenReader::isBinary()
+{
+  return binary;
+}
+
+void
+TokenReader::setNullFlush(bool val)
+{
+  nullFlush = val;
+}
+
+TokenKind
+TokenReader::next(Token& tok)
+{
+  tok.blank.clear();
+  tok.wblank.clear();
+  tok.source.clear();
+  tok.target.clear();
+  tok.coref.clear();
+  cur.clear();
+  return (binary ? nextBinary(tok) : nextText(tok));
+}
+
+TokenKind
+TokenReader::nextText(Token& tok)
+{
+  int pos = 0;
+  while(true)
+  {
+    // ordinary characters are appended to cur in every state
+    infile.readSpan(cur);
+    UChar32 val = infile.get();
+    if (infile.eof() || (nullFlush && val == '\0')) {
+      tok.blank.swap(cur);
+      return TokenEnd;
+    }
+    else if(val == '\\')
+    {
+      cur += '\\';
+      cur += infile.get();
+    }
+    else if(val == '[' && !inword)
+    {
+      val = infile.get();
+
+      if(val == '[')
+      {
+        inwblank = true;
+        tok.blank.swap(cur);
+        return TokenBlank;
+      }
+      else
+      {
+        infile.unget(val);
+        cur += infile.readBlock('[', ']');
+      }
+    }
+    else if(inwblank)
+    {
+      if(val == ']')
+      {
+        cur += val;
+        val = infile.get();
+
+        if(val == '\\')
+        {
+          cur += '\\';
+          cur += infile.get();
+        }
+        else if(val == ']')
+        {
+          cur += val;
+          val = infile.get();
+
+          if(val == '\\')
+          {
+            cur += '\\';
+            cur += infile.get();
+          }
+          else if(val == '^')
+          {
+            inwblank = false;
+            cur = "[["_u + cur;
+            tok.wblank.swap(cur);
+            cur.clear();
+            inword = true;
+          }
+          else
+          {
+            throw runtime_error("Parse Error: Wordbound blank should be immediately followed by a Lexical Unit -> [[..]]^..$");
+          }
+        }
+        else
+        {
+          cur += val;
+        }
+      }
+      else
+      {
+        cur += val;
+      }
+    }
+    else if(inword && (val == '$' || val == '/'))
+    {
+      if(pos == 0)
+      {
+        tok.source.swap(cur);
+      }
+      else if(pos == 1)
+      {
+        tok.target.swap(cur);
+      }
+      else if(pos >= 2 && val == '$')
+      {
+        tok.coref.swap(cur);
+      }
+      cur.clear();
+      pos++;
+      if(val == '$')
+      {
+        inword = false;
+        return TokenWord;
+      }
+    }
+    else if(!inword && val == '^')
+    {
+      inword = true;
+      tok.blank.swap(cur);
+      return TokenBlank;
+    }
+    else
+    {
+      cur += val;
+    }
+  }
+}
+
+void
+TokenReader::readSegment(string& dest)
+{
+  // all the characters that matter are ASCII, so the bytes can be
+  // copied without decoding them
+  bool word = false;
+  bool wordBlank = false;
+  int prev = 0;
+  int c;
+  while((c = infile.getByte()) != -1 && c != '\0')
+  {
+    dest += (char)c;
+    if(c == '\\')
+    {
+      if((c = infile.getByte()) == -1) break;
+      dest += (char)c;
+      c = 0;
+    }
+    else if(c == '[' && !word)
+    {
+      if((c = infile.getByte()) == -1) break;
+      dest += (char)c;
+      if(c == '[')
+      {
+        wordBlank = true;
+        c = 0;
+        continue;
+      }
+      // a superblank, which may contain \0, read as BlockReader::readBlock() does
+      while(true)
+      {
+        if(c == '\\')
+        {
+          if((c = infile.getByte()) == -1) return;
+          dest += (char)c;
+        }
+        if(c == ']') break;
+        if((c = infile.getByte()) == -1) return;
+        dest += (char)c;
+      }
+      c = 0;
+    }
+    else if(wordBlank)
+    {
+      // ]] ends it, and the LU it belongs to follows
+      if(c == ']' && prev == ']')
+      {
+        wordBlank = false;
+        c = 0;
+      }
+    }
+    else if(c == '^' && !word)
+    {
+      word = true;
+    }
+    else if(c == '$' && word)
+    {
+      word = false;
+    }
+    prev = c;
+  }
+}
+
+void
+TokenReader::truncated()
+{
+  throw runtime_error("Error: binary input ends in the middle of a record.");
+}
+
+size_t
+TokenReader::readNumber()
+{
+  size_t ret = 0;
+  for(int shift = 0; ; shift += 7)
+  {
+    int b = infile.getByte();
+    if(b == -1)
+    {
+      truncated();
+    }
+    if(shift < 64)
+    {
+      ret |= (size_t)(b & 0x7F) << shift;
+    }
+    if(!(b & 0x80))
+    {
+      return ret;
+    }
+  }
+}
+
+void
+TokenReader::readPlain(UString& dest)
+{
+  size_t len = readNumber();
+  bytes.clear();
+  if(!infile.readBytes(len, bytes))
+  {
+    truncated();
+  }
+  appendUtf8(bytes, dest);
+}
+
+void
+TokenReader::readTagged(UString& dest)
+{
+  while(true)
+  {
+    size_t n = readNumber();
+    if(n == 0)
+    {
+      return;
+    }
+    else if(n % 2 == 1)
+    {
+      if(n/2 >= streamTags.size())
+      {
+        ostringstream msg;
+        msg << "Error: binary input uses tag " << n/2 << " before defining it.";
+        throw runtime_error(msg.str());
+      }
+      dest += streamTags[n/2];
+    }
+    else
+    {
+      bytes.clear();
+      if(!infile.readBytes(n/2, bytes))
+      {
+        truncated();
+      }
+      appendUtf8(bytes, dest);
+    }
+  }
+}
+
+TokenKind
+TokenReader::nextBinary(Token& tok)
+{
+  if(havePendingWord)
+  {
+    havePendingWord = false;
+    tok.wblank.swap(pendingWord.wblank);
+    tok.source.swap(pendingWord.source);
+    tok.target.swap(pendingWord.target);
+    tok.coref.swap(pendingWord.coref);
+    return TokenWord;
+  }
+  if(!checkedMagic)
+  {
+    checkedMagic = true;
+    bytes.clear();
+    if(infile.readBytes(BinaryStreamMagicLength, bytes))
+    {
+      if(memcmp(bytes.data(), BinaryStreamMagic, BinaryStreamMagicLength) != 0)
+      {
+        throw runtime_error("Error: input is not in the binary stream format.");
+      }
+    }
+    else if(!bytes.empty())
+    {
+      truncated();
+    }
+  }
+  while(true)
+  {
+    int kind = infile.getByte();
+    switch(kind)
+    {
+      case -1:
+        tok.blank.swap(cur);
+        return TokenEnd;
+      case BinaryBlank:
+        readPlain(cur);
+        break;
+      case BinaryTag:
+        streamTags.push_back(UString());
+        readPlain(streamTags.back());
+        break;
+      case BinaryNull:
+        if(nullFlush)
+        {
+          tok.blank.swap(cur);
+          return TokenEnd;
+        }
+        cur += '\0';
+        break;
+      case BinaryWord:
+        // as in the text format, every LU is preceded by a blank
+        pendingWord.wblank.clear();
+        pendingWord.source.clear();
+        pendingWord.target.clear();
+        pendingWord.coref.clear();
+        readPlain(pendingWord.wblank);
+        readTagged(pendingWord.source);
+        readTagged(pendingWord.target);
+        readTagged(pendingWord.coref);
+        havePendingWord = true;
+        tok.blank.swap(cur);
+        return TokenBlank;
+      default:
+        ostringstream msg;
+        msg << "Error: unknown record type " << kind << " in binary input.";
+        throw runtime_error(msg.str());
+    }
+  }
+}
@@ -0,0 +1,122 @@
+#ifndef __RTXTOKENREADER__
+#define __RTXTOKENREADER__
+
+#include <rtx_config.h>
+#include <block_reader.h>
+#include <binary_stream.h>
+#include <lttoolbox/ustring.h>
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/**
+ * What TokenReader::next() found
+ */
+enum TokenKind
+{
+  /**
+   * A blank, which is returned before every LU even if it's empty
+   */
+  TokenBlank,
+  /**
+   * An LU
+   */
+  TokenWord,
+  /**
+   * The blank before a null flush or the end of the input
+   */
+  TokenEnd
+};
+
+struct Token
+{
+  /**
+   * The text of a TokenBlank or TokenEnd
+   */
+  UString blank;
+
+  /**
+   * The fields of a TokenWord
+   * coref is the last field of an LU with three or more,
+   * whether or not the input came from apertium-anaphora
+   */
+  UString wblank;
+  UString source;
+  UString target;
+  UString coref;
+};
+
+/**
+ * Splits the input stream into blanks and LUs,
+ * from either the text format or the binary stream format
+ */
+class TokenReader
+{
+private:
+  BlockReader infile;
+  bool binary;
+  bool nullFlush;
+
+  /**
+   * Working string, kept as a member so its storage is reused
+   */
+  UString cur;
+
+  /**
+   * true if the next input token should be parsed as an LU, false otherwise
+   */
+  bool inword;
+
+  /**
+   * true if the next input token should be parsed as a wordbound blank, false otherwise
+   */
+  bool inwblank;
+
+  /**
+   * Binary input state: the tags defined so far, whether the magic
+   * number has been checked, and an LU waiting to be returned after
+   * the blank that precedes it
+   */
+  vector<UString> streamTags;
+  bool checkedMagic;
+  bool havePendingWord;
+  Token pendingWord;
+  string bytes;
+
+  TokenKind nextText(Token& tok);
+  TokenKind nextBinary(Token& tok);
+  size_t readNumber();
+  void readPlain(UString& dest);
+  void readTagged(UString& dest);
+  void truncated();
+public:
+  TokenReader();
+  void wrap(FILE* in);
+  bool eof();
+  void setBinary(bool val);
+  bool isBinary();
+
+  /**
+   * If true, \0 ends a segment, otherwise it is part of a blank
+   */
+  void setNullFlush(bool val);
+
+  /**
+   * Read the next blank or LU
+   * The fields of tok that don't apply are left empty
+   */
+  TokenKind next(Token& tok);
+
+  /**
+   * Copy the text of the next null-flushed segment to dest, without the \0
+   * Segments end where next() would return TokenEnd, so escaped nulls and
+   * nulls inside superblanks don't end them
+   * Only for the text format, and each segment starts outside any LU
+   */
+  void readSegment(string& dest);
+};
+
+#endif
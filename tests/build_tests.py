@@ -22,17 +22,30 @@ class InterpreterTest:
     input = ''
     output = ''
     lex_file = ''
+    base_flags = []
+    flags = []
     def setUp(self):
         args = ['../src/rtx-comp']
         if len(self.lex_file) > 0:
             args += ['-l', self.lex_file]
         args += [self.rules_file, self.bin_file]
         subprocess.check_output(args, stderr=subprocess.STDOUT, universal_newlines=True)
+    def run_proc(self, flags):
+        data = self.input.encode('utf-8')
+        if '-i' in flags:
+            data = subprocess.check_output(['../src/rtx-stream'], input=data)
+        args = ['../src/rtx-proc', '-a'] + flags + [self.bin_file]
+        actual = subprocess.check_output(args, input=data, timeout=60)
+        if '-o' in flags:
+            actual = subprocess.check_output(['../src/rtx-stream', '-d'], input=actual)
+        return actual.decode('utf-8')
     def test_output(self):
-        args = ['../src/rtx-proc', '-a', self.bin_file]
-        actual = subprocess.check_output(args, input=self.input, universal_newlines=True)
         self.maxDiff = None
-        self.assertEqual(self.output, actual)
+        self.assertEqual(self.output, self.run_proc(self.base_flags))
+        # every other mode must give the same output as the plain run
+        for flags in self.flags:
+            with self.subTest(flags=' '.join(flags)):
+                self.assertEqual(self.output, self.run_proc(self.base_flags + flags))
 
 
 ''')
@@ -75,10 +88,10 @@ for fname in ls:
         base, ext = fname.split('.')
         if (base + '.input') in ls:
             fi = open(base + '.input')
-            i = fi.read()
+            i = fi.read().replace('\\', '\\\\').replace('\0', '\\x00')
             fi.close()
             fo = open(base + '.output')
-            o = fo.read()
+            o = fo.read().replace('\\', '\\\\').replace('\0', '\\x00')
             fo.close()
             if ext == 'trx':
                 f.write(run_xml.format(base, i, o))
@@ -86,6 +99,14 @@ for fname in ls:
                 f.write(run.format(base, i, o))
             if (base + '.lex') in ls:
                 f.write("    lex_file = '%s.lex'\n" % base)
+            if (base + '.flags') in ls:
+                # the first line is used for every run (and may be empty),
+                # each other line is a set of options to try on top of it
+                ff = open(base + '.flags')
+                lines = ff.read().split('\n')
+                ff.close()
+                f.write("    base_flags = %r\n" % lines[0].split())
+                f.write("    flags = %r\n" % [l.split() for l in lines[1:] if l.strip()])
         else:
             f.write(err.format(base))
 for fname in listdir('./cookbook'):